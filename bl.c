@@ -6,6 +6,7 @@
 
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 
 #if   defined(STM32F4)
 # include <libopencm3/stm32/f4/rcc.h>
@@ -17,11 +18,15 @@
 # include <libopencm3/stm32/f1/gpio.h>
 # include <libopencm3/stm32/f1/flash.h>
 # include <libopencm3/stm32/f1/scb.h>
+#elif defined(SIM)
+# include "sim.h"
 #else
 # error Unsupported chip
 #endif
 
-#include <libopencm3/stm32/systick.h>
+#ifndef SIM
+# include <libopencm3/stm32/systick.h>
+#endif
 
 #include "bl.h"
 
@@ -43,18 +48,88 @@
 //
 // GET_SYNC		verify that the board is present
 // GET_DEVICE		determine which board (select firmware to upload)
+// SET_BAUD		optionally move to a faster line rate; the reply comes at the
+//			old rate, and the old rate returns unless a command gets
+//			through at the new one within a second
 // CHIP_ERASE		erase the program area and reset address counter
+//  or  LAZY_ERASE      as CHIP_ERASE, but only erase sectors as programming reaches them
 // loop:
 //      PROG_MULTI      program bytes
+//  or  PROG_SEQ        program bytes, with up to GET_DEVICE(RX_WINDOW) bytes of
+//                      commands sent ahead of the replies
+//  or  PROG_BULK       as PROG_SEQ, up to GET_DEVICE(BULK_MAX) bytes at a time
+//  or  PROG_LZ4        as PROG_BULK, with each block LZ4-compressed
+//  and PROG_SKIP       move over runs of 0xff, which erased flash already holds
 // CHIP_VERIFY		finalise flash programming and reset address counter
 // loop:
 //	READ_MULTI	readback bytes
+//  or  READ_BULK       readback up to GET_DEVICE(BULK_MAX) bytes at a time
+//  or  GET_CRC         checksum the whole image in one go
 // RESET		resets chip and starts application
 //
+// Alternatively, to update only what has changed:
+//
+// loop:
+//	GET_SECTOR	size and CRC of each sector, until the size is zero
+// loop, for each sector that differs from the new image:
+//	ERASE_SECTOR	erase the sector
+//	SET_ADDRESS	move to the start of the sector and reset sequence numbers
+//	PROG_BULK	program bytes
+//
+// Sequenced program commands are acknowledged once the block has been
+// checked, and programmed while the next one is received; a block that does
+// not program correctly fails the reply to a later program command,
+// SET_ADDRESS, CHIP_VERIFY or RESET.
+//
+// Sector 0 must be rewritten whenever anything is, as the first word of
+// the image is only programmed at RESET.
+//
+// Revision 2 is the original protocol: GET_SYNC, GET_DEVICE(1-4),
+// CHIP_ERASE, PROG_MULTI, CHIP_VERIFY, READ_MULTI and RESET.  Revision 3
+// adds PROG_BULK, GET_CRC and GET_DEVICE(5-7); everything else above, and
+// framing below, is optional and only used if GET_DEVICE(FEATURES) has
+// its PROTO_FEATURE_ bit set.
+//
+// Framed commands (PROTO_FEATURE_FRAMES):
+//
+//      <FRAME><len_lo><len_hi><seq><opcode>[<command_data>]<EOC><crc_lo><crc_hi>
+//
+// Framed replies:
+//
+//      <FRAME><len_lo><len_hi><seq><status><error>[<reply_data>]<crc_lo><crc_hi>
+//
+// Any command may be sent in a frame instead; <len> counts the bytes from
+// <opcode> to <EOC>, the CRC is CRC-16/CCITT-FALSE over everything from
+// <len> up to it, and <len> in a reply counts <reply_data> only.  The reply
+// carries the frame's <seq> and, on failure, one of the PROTO_ERR_ codes.
+// Frames are checked whole before anything is done with them: a damaged or
+// incomplete one is answered with FAILED and PROTO_ERR_CRC and otherwise
+// ignored, and the host may send it again straight away.  A frame with the
+// same <seq> as the last one is taken as a retry because its reply was lost;
+// the reply is sent again without repeating the command (reads are simply
+// done again).  A sequenced block the bootloader already has, sent again in
+// a new frame because a NAK came back before the reply to it, is likewise
+// acknowledged without being programmed twice.  Once a frame has been
+// carried out, anything outside a frame is taken for the remains of a
+// damaged one and answered the same way, so the FRAME marker is also where
+// the two ends get back into step; frames are then all that is understood
+// until the bootloader is next entered, or until an unframed GET_SYNC comes
+// after the link has been quiet for a while, as from a tool that knows
+// nothing of the session and starts again.
+//
+// Keepalives, with framing: while the reply to a frame is held up by the flash,
+// as for CHIP_ERASE or a block waiting on an erase, and whenever an erase is
+// under way once frames are in use, a reply frame with status BUSY and no
+// data goes out every 100ms or so, under the <seq> of the frame in hand or
+// else the last one.  It is never the reply, and the host need only take it
+// as a sign to keep waiting, so that its timeouts need not allow for the
+// longest erase.
+//
 
 #define PROTO_OK		0x10    // 'ok' response
 #define PROTO_FAILED		0x11    // 'fail' response
 #define PROTO_INSYNC		0x12    // 'in sync' byte sent before status
+#define PROTO_BUSY		0x13    // keepalive in place of a framed reply, see above
 
 #define PROTO_EOC		0x20    // end of command
 #define PROTO_GET_SYNC		0x21    // NOP for re-establishing sync
@@ -63,61 +138,273 @@
 #define PROTO_CHIP_VERIFY	0x24    // reset program address for verification
 #define PROTO_PROG_MULTI	0x27    // write bytes at address + increment	<command_data>: <count><databytes>
 #define PROTO_READ_MULTI	0x28    // read bytes at address + increment	<command_data>: <count>,  <reply_data>: <databytes>
+#define PROTO_PROG_SEQ		0x29    // PROG_MULTI with sequence number	<command_data>: <seq><count><databytes>, <reply_data>: <seq>
+#define PROTO_PROG_BULK		0x2a    // PROG_SEQ with 16-bit count	<command_data>: <seq><count_lo><count_hi><databytes>, <reply_data>: <seq>
+#define PROTO_READ_BULK		0x2b    // READ_MULTI with 16-bit count	<command_data>: <count_lo><count_hi>, <reply_data>: <databytes>
+#define PROTO_GET_CRC		0x2c    // CRC32 over [0, length) of the program area	<command_data>: <length>, <reply_data>: <crc>
+#define PROTO_PROG_LZ4		0x2d    // PROG_BULK with an LZ4 block	<command_data>: <seq><count_lo><count_hi><lz4 block>, <reply_data>: <seq>
+#define PROTO_GET_SECTOR	0x2e    // size and CRC32 of a flash sector	<command_data>: <sector>, <reply_data>: <size><crc>
+#define PROTO_ERASE_SECTOR	0x2f    // erase a single flash sector	<command_data>: <sector>
+#define PROTO_SET_ADDRESS	0x32    // set program address and reset sequence	<command_data>: <address>
+#define PROTO_LAZY_ERASE	0x33    // reset program address, erase sectors when programming reaches them
+#define PROTO_PROG_SKIP		0x34    // advance address over erased bytes, sequenced	<command_data>: <seq><count>, <reply_data>: <seq>
+#define PROTO_SET_BAUD		0x35    // change the interface line rate	<command_data>: <baud>
 
 #define PROTO_BOOT		0x30    // boot the application
 
-#define PROTO_DEBUG		0x31    // emit debug information - format not defined
+#define PROTO_DEBUG		0x31    // report performance counters	<reply_data>: <counters>, see perf_report()
+
+#define PROTO_FRAME		0x7e    // start of a framed command or reply
+
+/* error codes in framed replies */
+#define PROTO_ERR_NONE		0
+#define PROTO_ERR_CRC		1	// the frame was damaged or cut short; nothing was done
+#define PROTO_ERR_LENGTH	2	// the command was malformed, or a count was wrong
+#define PROTO_ERR_ADDRESS	3	// outside the program area
+#define PROTO_ERR_FLASH		4	// flash did not program correctly
+#define PROTO_ERR_SEQUENCE	5	// a sequenced block arrived out of order
+#define PROTO_ERR_DATA		6	// a compressed block would not decode
+#define PROTO_ERR_COMMAND	7	// unknown command or GET_DEVICE argument
 
 #define PROTO_PROG_MULTI_MAX    64	// maximum PROG_MULTI size
 #define PROTO_READ_MULTI_MAX    255	// size of the size field
+#ifndef PROTO_BULK_MAX
+# define PROTO_BULK_MAX		1024	// maximum PROG_BULK/READ_BULK size, normally set per chip
+#endif
+
+// Optional commands, as reported by GET_DEVICE(FEATURES).  Chips short of
+// flash build with PROTO_SMALL, which has none of them: just the revision 3
+// commands, carried out one at a time as they arrive.
+#define PROTO_FEATURE_LZ4	(1 << 0)	// PROG_LZ4
+#define PROTO_FEATURE_SKIP	(1 << 1)	// PROG_SKIP
+#define PROTO_FEATURE_DEBUG	(1 << 2)	// DEBUG
+#define PROTO_FEATURE_FRAMES	(1 << 3)	// framed commands and replies, and BUSY
+#define PROTO_FEATURE_SECTORS	(1 << 4)	// GET_SECTOR, ERASE_SECTOR and SET_ADDRESS
+#define PROTO_FEATURE_LAZY	(1 << 5)	// LAZY_ERASE
+#define PROTO_FEATURE_READ_BULK	(1 << 6)	// READ_BULK
+#define PROTO_FEATURE_BAUD	(1 << 7)	// SET_BAUD
+#define PROTO_FEATURE_SEQ	(1 << 8)	// PROG_SEQ
+#ifdef PROTO_SMALL
+# define PROTO_FEATURES		0
+#else
+# define PROTO_FEATURES		(PROTO_FEATURE_LZ4 | PROTO_FEATURE_SKIP | PROTO_FEATURE_DEBUG | \
+				 PROTO_FEATURE_FRAMES | PROTO_FEATURE_SECTORS | PROTO_FEATURE_LAZY | \
+				 PROTO_FEATURE_READ_BULK | PROTO_FEATURE_BAUD | PROTO_FEATURE_SEQ)
+#endif
 
 /* argument values for PROTO_GET_DEVICE */
 #define PROTO_DEVICE_BL_REV	1
 #define PROTO_DEVICE_BOARD_ID	2
 #define PROTO_DEVICE_BOARD_REV	3
 #define PROTO_DEVICE_FW_SIZE	4
+#define PROTO_DEVICE_RX_WINDOW	5	// bytes of commands the host may send ahead of replies
+#define PROTO_DEVICE_BULK_MAX	6	// largest PROG_BULK/READ_BULK count
+#define PROTO_DEVICE_FEATURES	7	// PROTO_FEATURE_ bits for the optional commands
+
+static const uint32_t	bl_proto_rev = 3;	// value returned by PROTO_DEVICE_BL_REV
 
-static const uint32_t	bl_proto_rev = 2;	// value returned by PROTO_DEVICE_BL_REV
+/*
+ * The receive buffer is filled from interrupt context and emptied by the
+ * bootloader; head is only written by the producer and tail only by the
+ * consumer, with a barrier between touching the data and publishing the index.
+ */
+#if (RX_BUF_SIZE & (RX_BUF_SIZE - 1)) != 0
+# error RX_BUF_SIZE must be a power of two
+#endif
+#define RX_BUF_MASK	(RX_BUF_SIZE - 1)
 
-static unsigned head, tail;
-static uint8_t rx_buf[256];
+static volatile unsigned head, tail;
+static uint8_t rx_buf[RX_BUF_SIZE];
+volatile unsigned buf_overflows;
 
 void sys_tick_handler(void);
 
-void
+volatile unsigned systick_count;
+
+#ifndef PROTO_SMALL
+/*
+ * Where the time goes, returned by PROTO_DEBUG.  Times are in perf_cycles()
+ * units, which run at board_info.systick_mhz.
+ */
+static struct {
+	uint64_t	erase_cycles;		/* erasing sectors */
+	uint64_t	program_cycles;		/* programming (and reading back) words */
+	uint64_t	wait_cycles;		/* waiting for the host */
+	uint32_t	bytes_received;
+	uint32_t	commands;
+	uint32_t	sectors_erased;
+	uint32_t	words_programmed;
+	uint32_t	boot_check_cycles;	/* the last check of the application */
+} perf;
+
+/*
+ * Erasing goes on in the background: a sector erase is started and left to
+ * the flash controller, and the bootloader gets on with other things until
+ * it has finished.  Sectors from limit up to target are erased in turn (see
+ * erase_step()).
+ */
+static struct {
+	unsigned	limit;		/* flash below here is erased, or to be left alone */
+	unsigned	target;		/* erase up to here */
+	bool		all;		/* erase sectors even if they are blank already */
+	bool		busy;		/* a sector erase is under way */
+	unsigned	end;		/* where limit moves once it is done */
+	uint32_t	start;		/* perf_cycles() when it began */
+} erase;
+
+static RAMFUNC void keepalive(void);
+
+/*
+ * Start erasing a sector.  Where flash can't be read meanwhile, the erase is
+ * seen through here in RAM instead (see RAMFUNC), keeping any reply it holds
+ * up alive and sleeping between interrupts; flash_erase_done() then finds it
+ * over straight away.
+ */
+static RAMFUNC void
+flash_erase(unsigned sector, unsigned end)
+{
+	erase.start = perf_cycles();
+	erase.end = end;
+	erase.busy = true;
+	flash_func_erase_start(sector);
+#ifdef ERASE_WAIT_IN_RAM
+	while (flash_func_busy()) {
+		keepalive();
+		cidle();
+	}
+#endif
+}
+
+/* returns true once an erase that was under way has finished */
+static bool
+flash_erase_done(void)
+{
+	if (!erase.busy || flash_func_busy())
+		return false;
+	erase.busy = false;
+	erase.limit = erase.end;
+	perf.erase_cycles += perf_cycles() - erase.start;
+	perf.sectors_erased++;
+	return true;
+}
+#endif
+
+RAMFUNC void
 buf_put(uint8_t b)
 {
-	unsigned next = (head + 1) % sizeof(rx_buf);
+	unsigned next = (head + 1) & RX_BUF_MASK;
 
-	if (next != tail) {
-		rx_buf[head] = b;
-		head = next;
+	if (next == tail) {
+		buf_overflows++;
+		return;
 	}
+	rx_buf[head] = b;
+	__sync_synchronize();
+	head = next;
 }
 
 int
 buf_get(void)
 {
-	int	ret = -1;
-
-	if (tail != head) {
-		ret = rx_buf[tail];
-		tail = (tail + 1) % sizeof(rx_buf);
-	}
+	int	ret;
+
+	if (tail == head)
+		return -1;
+	__sync_synchronize();
+	ret = rx_buf[tail];
+	__sync_synchronize();
+	tail = (tail + 1) & RX_BUF_MASK;
 	return ret;
 }
 
+unsigned
+buf_read(uint8_t *buf, unsigned len)
+{
+	unsigned t = tail;
+	unsigned avail = (head - t) & RX_BUF_MASK;
+	unsigned chunk;
+
+	if (len > avail)
+		len = avail;
+	if (len == 0)
+		return 0;
+	__sync_synchronize();
+
+	/* at most two copies, either side of the wrap */
+	chunk = RX_BUF_SIZE - t;
+	if (chunk > len)
+		chunk = len;
+	memcpy(buf, &rx_buf[t], chunk);
+	memcpy(buf + chunk, &rx_buf[0], len - chunk);
+
+	__sync_synchronize();
+	tail = (t + len) & RX_BUF_MASK;
+	return len;
+}
+
+RAMFUNC bool
+buf_empty(void)
+{
+	return tail == head;
+}
+
+RAMFUNC unsigned
+buf_space(void)
+{
+	return (tail - head - 1) & RX_BUF_MASK;
+}
+
 static void
 do_jump(uint32_t stacktop, uint32_t entrypoint)
 {
+#ifdef SIM
+	sim_boot(stacktop, entrypoint);
+#else
 	asm volatile(
 		"msr msp, %0	\n"
 		"bx	%1	\n"
 		: : "r" (stacktop), "r" (entrypoint) : );
+#endif
 	// just to keep noreturn happy
 	for (;;) ;
 }
 
+/*
+ * Check the application descriptor, if the image has one (see bl.h).
+ *
+ * This runs on every boot, so the image is read in place and handed to the
+ * CRC in bulk rather than a word at a time.  The time it takes is kept for
+ * PROTO_DEBUG.
+ */
+static bool
+app_valid(void)
+{
+	const uint32_t *app_base = (const uint32_t *)APP_LOAD_ADDRESS;
+	const uint32_t *desc = app_base + (APP_DESC_OFFSET / 4);
+#ifndef PROTO_SMALL
+	uint32_t start = perf_cycles();
+#endif
+	uint32_t length;
+	bool valid = false;
+
+	if (desc[0] != APP_DESC_MAGIC)
+		return true;
+
+	length = desc[1];
+	if (((length % 4) == 0) &&
+	    (length >= (APP_DESC_OFFSET + 12)) &&
+	    (length <= board_info.fw_size)) {
+		crc32_reset();
+		crc32_block(app_base, (APP_DESC_OFFSET / 4) + 2);
+		valid = (crc32_block(desc + 3, (length - APP_DESC_OFFSET - 12) / 4) == desc[2]);
+	}
+
+#ifndef PROTO_SMALL
+	perf.boot_check_cycles = perf_cycles() - start;
+#endif
+	return valid;
+}
+
 void
 jump_to_app()
 {
@@ -137,6 +424,12 @@ jump_to_app()
 		return;
 	if (app_base[1] >= (APP_LOAD_ADDRESS + board_info.fw_size))
 		return;
+	/*
+	 * If the image describes itself, it must be whole; this catches images
+	 * that were corrupted or only partly written.
+	 */
+	if (!app_valid())
+		return;
 
 	/* just for paranoia's sake */
 	flash_lock();
@@ -152,6 +445,9 @@ jump_to_app()
 	/* the interface */
 	cfini();
 
+	/* the clocks, which the application expects to find as at reset */
+	board_deinit();
+
 	/* switch exception handlers to the application */
 	SCB_VTOR = APP_LOAD_ADDRESS;
 
@@ -161,11 +457,13 @@ jump_to_app()
 
 volatile unsigned timer[NTIMERS];
 
-void
+RAMFUNC void
 sys_tick_handler(void)
 {
 	unsigned i;
 
+	systick_count++;
+
 	for (i = 0; i < NTIMERS; i++)
 		if (timer[i] > 0)
 			timer[i]--;
@@ -185,17 +483,32 @@ delay(unsigned msec)
 		;
 }
 
-static void
-sync_response(void)
+static uint32_t
+crc_program_area(unsigned start, unsigned length, uint32_t first_word)
 {
-	uint8_t data[] = {
-		PROTO_INSYNC,	// "in sync"
-		PROTO_OK	// "OK"
-	};
-
-	cout(data, sizeof(data));
+	unsigned address;
+	uint32_t crc = 0xffffffff;
+
+	crc32_reset();
+	for (address = start; address < (start + length); address += 4) {
+		/* as for readback, the not-yet-programmed first word counts */
+		if ((address == 0) && (first_word != 0xffffffff)) {
+			crc = crc32_word(first_word);
+		} else {
+			crc = crc32_word(flash_func_read_word(address));
+		}
+	}
+	return crc;
 }
 
+#ifdef PROTO_SMALL
+/*
+ * The small protocol (PROTO_SMALL): the revision 3 commands and nothing
+ * else, each taken in and carried out before the next is looked at, as the
+ * original bootloader did.  There is no framing, nothing is sent ahead of a
+ * reply, and a command that doesn't make sense is left for the host to time
+ * out on.
+ */
 static int
 cin_wait(unsigned timeout)
 {
@@ -214,12 +527,49 @@ cin_wait(unsigned timeout)
 	return c;
 }
 
+/* take in the next len bytes of a command, or return -1 if they don't come */
+static int
+cin_bytes(uint8_t *buf, unsigned len)
+{
+	int c;
+
+	while (len--) {
+		c = cin_wait(1000);
+		if (c < 0)
+			return -1;
+		*buf++ = c;
+	}
+	return 0;
+}
+
 static void
 cout_word(uint32_t val)
 {
 	cout((uint8_t *)&val, 4);
 }
 
+static void
+sync_response(void)
+{
+	uint8_t data[] = {
+		PROTO_INSYNC,	// "in sync"
+		PROTO_OK	// "OK"
+	};
+
+	cout(data, sizeof(data));
+}
+
+static void
+failure_response(void)
+{
+	uint8_t data[] = {
+		PROTO_INSYNC,	// "in sync"
+		PROTO_FAILED	// "command failed"
+	};
+
+	cout(data, sizeof(data));
+}
+
 void
 bootloader(unsigned timeout)
 {
@@ -228,9 +578,12 @@ bootloader(unsigned timeout)
 	unsigned	i;
 	unsigned	address = board_info.fw_size;	/* force erase before upload will work */
 	uint32_t	first_word = 0xffffffff;
+	uint32_t	length = 0;
+	uint8_t		seq = 0;
+	uint8_t		next_seq = 0;
 	static union {
-		uint8_t		c[256];
-		uint32_t	w[64];
+		uint8_t		c[PROTO_BULK_MAX];
+		uint32_t	w[PROTO_BULK_MAX / 4];
 	} flash_buffer;
 
 	/* (re)start the timer system */
@@ -262,7 +615,6 @@ bootloader(unsigned timeout)
 		case PROTO_GET_SYNC:
 		case PROTO_CHIP_ERASE:
 		case PROTO_CHIP_VERIFY:
-		case PROTO_DEBUG:
 			/* expect EOC */
 			if (cin_wait(1000) != PROTO_EOC)
 				goto cmd_bad;
@@ -275,6 +627,18 @@ bootloader(unsigned timeout)
 				goto cmd_bad;
 			break;
 
+		case PROTO_PROG_BULK:
+			/* expect sequence number then 16-bit count, little-endian */
+			arg = cin_wait(1000);
+			if (arg < 0)
+				goto cmd_bad;
+			seq = arg;
+			length = 0;
+			if (cin_bytes((uint8_t *)&length, 2) < 0)
+				goto cmd_bad;
+			arg = length;
+			break;
+
 		case PROTO_GET_DEVICE:
 		case PROTO_READ_MULTI:
 			/* expect arg/count then EOC */
@@ -284,6 +648,14 @@ bootloader(unsigned timeout)
 			if (cin_wait(1000) != PROTO_EOC)
 				goto cmd_bad;
 			break;
+
+		case PROTO_GET_CRC:
+			/* expect 32-bit length, little-endian, then EOC */
+			if (cin_bytes((uint8_t *)&length, 4) < 0)
+				goto cmd_bad;
+			if (cin_wait(1000) != PROTO_EOC)
+				goto cmd_bad;
+			break;
 		}
 
 		// handle the command byte
@@ -310,6 +682,19 @@ bootloader(unsigned timeout)
 			case PROTO_DEVICE_FW_SIZE:
 				cout((uint8_t *)&board_info.fw_size, sizeof(board_info.fw_size));
 				break;
+
+			case PROTO_DEVICE_RX_WINDOW:
+				cout_word(cin_window());
+				break;
+
+			case PROTO_DEVICE_BULK_MAX:
+				cout_word(sizeof(flash_buffer.c));
+				break;
+
+			case PROTO_DEVICE_FEATURES:
+				cout_word(PROTO_FEATURES);
+				break;
+
 			default:
 				goto cmd_bad;
 			}
@@ -317,9 +702,13 @@ bootloader(unsigned timeout)
 
 		case PROTO_CHIP_ERASE:          // erase the program area + read for programming
 			flash_unlock();
-			for (i = 0; flash_func_sector_size(i) != 0; i++)
-				flash_func_erase_sector(i);
+			for (i = 0; flash_func_sector_size(i) != 0; i++) {
+				flash_func_erase_start(i);
+				while (flash_func_busy())
+					;
+			}
 			address = 0;
+			next_seq = 0;
 			break;
 
 		case PROTO_CHIP_VERIFY:		// reset for verification of the program area
@@ -327,20 +716,26 @@ bootloader(unsigned timeout)
 			break;
 
 		case PROTO_PROG_MULTI:		// program bytes
-			if (arg % 4)
-				goto cmd_bad;
-			if ((address + arg) > board_info.fw_size)
-				goto cmd_bad;
+		case PROTO_PROG_BULK:		// program lots of bytes, sequenced
 			if (arg > sizeof(flash_buffer.c))
 				goto cmd_bad;
-			for (i = 0; i < arg; i++) {
-				c = cin_wait(1000);
-				if (c < 0)
-					goto cmd_bad;
-				flash_buffer.c[i] = c;
-			}
+			if (cin_bytes(flash_buffer.c, arg) < 0)
+				goto cmd_bad;
 			if (cin_wait(1000) != PROTO_EOC)
 				goto cmd_bad;
+
+			// the host waits for each reply, so a block out of order can
+			// only be one it has given up on
+			if (c == PROTO_PROG_BULK) {
+				cout(&seq, 1);
+				if (seq != next_seq)
+					goto cmd_fail;
+				next_seq++;
+			}
+			if (arg % 4)
+				goto cmd_fail;
+			if ((address + arg) > board_info.fw_size)
+				goto cmd_fail;
 			if (address == 0) {
 				// save the first word and don't program it until everything else is done
 				first_word = flash_buffer.w[0];
@@ -356,14 +751,14 @@ bootloader(unsigned timeout)
 
 		case PROTO_READ_MULTI:			// readback bytes
 			if (arg % 4)
-				goto cmd_bad;
+				goto cmd_fail;
 			if ((address + arg) > board_info.fw_size)
-				goto cmd_bad;
+				goto cmd_fail;
 			arg /= 4;
 
 			/* handle readback of the not-yet-programmed first word */
 			if ((address == 0) && (first_word != 0xffffffff)) {
-				cout((uint8_t *)&first_word, 4);
+				cout_word(first_word);
 				address += 4;
 				arg--;
 			}
@@ -373,6 +768,14 @@ bootloader(unsigned timeout)
 			}
 			break;
 
+		case PROTO_GET_CRC:			// checksum the program area
+			if (length % 4)
+				goto cmd_fail;
+			if (length > board_info.fw_size)
+				goto cmd_fail;
+			cout_word(crc_program_area(0, length, first_word));
+			break;
+
 		case PROTO_BOOT:
 			// program the deferred first word
 			if (first_word != 0xffffffff) {
@@ -385,10 +788,6 @@ bootloader(unsigned timeout)
 			// quiesce and jump to the app
 			return;
 
-		case PROTO_DEBUG:
-			// XXX reserved for ad-hoc debugging as required
-			break;
-
 		default:
 			continue;
 		}
@@ -399,12 +798,1194 @@ bootloader(unsigned timeout)
 		// send the sync response for this command
 		sync_response();
 		continue;
+cmd_fail:
+		// the command was well-formed but could not be carried out
+		timeout = 0;
+		failure_response();
+		continue;
 cmd_bad:
 		// Currently we do nothing & let the programming tool time out
 		// if that's what it wants to do.
 		// Let the initial delay keep counting down so that we ignore
 		// random chatter from a device.
-		while(true);
 		continue;
 	}
 }
+#else
+/*
+ * Framing (see the protocol description above).  While a framed command is
+ * being handled the reply is gathered up so that it can be sent again if the
+ * host asks.
+ */
+#define FRAME_TIMEOUT		100	/* ms allowed between pieces of a frame */
+
+#define FRAME_IN_HEAD		4	/* marker, length and seq */
+#define FRAME_HEAD		6	/* marker, length, seq, status and error */
+#define FRAME_TAIL		2	/* CRC */
+#define FRAME_REPLY_MAX		64	/* larger replies are streamed rather than kept */
+
+static struct {
+	bool		active;			/* the current command came in a frame */
+	uint8_t		seq;
+	uint16_t	crc;			/* of a streamed reply so far */
+	bool		streamed;		/* the reply is too big to keep, and goes out as made */
+	uint8_t		out[FRAME_HEAD + FRAME_REPLY_MAX + FRAME_TAIL];	/* the reply, kept for a retry */
+	unsigned	out_len;		/* reply data in out */
+	bool		session;		/* the host has moved to frames */
+	bool		done;			/* a frame was carried out, as described below */
+	uint8_t		done_seq;
+	uint8_t		done_status;
+	uint8_t		done_error;
+	unsigned	done_address;		/* the program address before it */
+	bool		held;			/* the reply waits on the flash; see keepalive() */
+} frame;
+
+/* CRC-16/CCITT-FALSE, bitwise as it only sees a frame once */
+static RAMFUNC uint16_t
+crc16(uint16_t crc, const uint8_t *p, unsigned len)
+{
+	unsigned i;
+
+	while (len--) {
+		crc ^= (uint16_t)*p++ << 8;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+	}
+	return crc;
+}
+
+/* fill in a reply header for len bytes of data, returning its CRC */
+static RAMFUNC uint16_t
+frame_header(uint8_t *buf, uint8_t status, uint8_t error, unsigned len)
+{
+	buf[0] = PROTO_FRAME;
+	buf[1] = len & 0xff;
+	buf[2] = len >> 8;
+	buf[3] = frame.seq;
+	buf[4] = status;
+	buf[5] = error;
+	return crc16(0xffff, buf + 1, FRAME_HEAD - 1);
+}
+
+/*
+ * Send a reply frame from buf, which holds len bytes of data after room for
+ * the header and has room for the CRC after them; it goes out in one piece,
+ * as the interface may send each piece in a packet of its own.
+ */
+static void
+frame_send(uint8_t *buf, uint8_t status, uint8_t error, unsigned len)
+{
+	uint16_t crc = crc16(frame_header(buf, status, error, len), buf + FRAME_HEAD, len);
+
+	buf[FRAME_HEAD + len] = crc & 0xff;
+	buf[FRAME_HEAD + len + 1] = crc >> 8;
+	cout(buf, FRAME_HEAD + len + FRAME_TAIL);
+	frame.active = false;
+}
+
+/* send the kept reply to the last frame */
+static void
+frame_reply(void)
+{
+	frame.seq = frame.done_seq;
+	frame_send(frame.out, frame.done_status, frame.done_error, frame.out_len);
+}
+
+/* finish the reply to a frame, and remember how it went */
+static void
+frame_done(uint8_t status, uint8_t error)
+{
+	uint8_t tail[FRAME_TAIL];
+
+	frame.session = true;
+	frame.done = true;
+	frame.done_seq = frame.seq;
+	frame.done_status = status;
+	frame.done_error = error;
+
+	if (frame.streamed) {
+		tail[0] = frame.crc & 0xff;
+		tail[1] = frame.crc >> 8;
+		cout(tail, sizeof(tail));
+		frame.active = false;
+	} else {
+		frame_reply();
+	}
+}
+
+/* refuse a damaged frame; the reply to the last good one is kept */
+static void
+frame_nak(uint8_t error)
+{
+	uint8_t buf[FRAME_HEAD + FRAME_TAIL];
+
+	frame_send(buf, PROTO_FAILED, error, 0);
+}
+
+/*
+ * Send a BUSY frame every KEEPALIVE_INTERVAL ms while the host may be kept
+ * waiting by the flash.  This is called each time round the command loop,
+ * and from flash_erase() where that waits; in the second case a block that
+ * will be held up may not have been taken in yet, hence erase.busy.
+ */
+#define KEEPALIVE_INTERVAL	100
+
+static RAMFUNC void
+keepalive(void)
+{
+	uint8_t buf[FRAME_HEAD + FRAME_TAIL];
+	uint16_t crc;
+	bool due = frame.held || (frame.session && erase.busy);
+
+	if (due && (timer[TIMER_KEEPALIVE] == 0)) {
+		crc = frame_header(buf, PROTO_BUSY, PROTO_ERR_NONE, 0);
+		buf[FRAME_HEAD] = crc & 0xff;
+		buf[FRAME_HEAD + 1] = crc >> 8;
+		cout(buf, sizeof(buf));
+	}
+	if (!due || (timer[TIMER_KEEPALIVE] == 0))
+		timer[TIMER_KEEPALIVE] = KEEPALIVE_INTERVAL;
+}
+
+/* send reply data, or keep it for the frame */
+static void
+reply(const void *data, unsigned len)
+{
+	if (!frame.active) {
+		cout((uint8_t *)data, len);
+	} else if (frame.streamed) {
+		frame.crc = crc16(frame.crc, data, len);
+		cout((uint8_t *)data, len);
+	} else if ((frame.out_len + len) <= FRAME_REPLY_MAX) {
+		memcpy(frame.out + FRAME_HEAD + frame.out_len, data, len);
+		frame.out_len += len;
+	}
+}
+
+/*
+ * A reply of len bytes is about to follow that is too big to keep; in a
+ * frame, commit to success and send it as it comes.
+ */
+static void
+reply_stream(unsigned len)
+{
+	uint8_t head[FRAME_HEAD];
+
+	if (frame.active) {
+		frame.crc = frame_header(head, PROTO_OK, PROTO_ERR_NONE, len);
+		cout(head, sizeof(head));
+		frame.streamed = true;
+	}
+}
+
+static void
+sync_response(void)
+{
+	uint8_t data[] = {
+		PROTO_INSYNC,	// "in sync"
+		PROTO_OK	// "OK"
+	};
+
+	if (frame.active) {
+		frame_done(PROTO_OK, PROTO_ERR_NONE);
+		return;
+	}
+	cout(data, sizeof(data));
+}
+
+static void
+failure_response(uint8_t error)
+{
+	uint8_t data[] = {
+		PROTO_INSYNC,	// "in sync"
+		PROTO_FAILED	// "command failed"
+	};
+
+	if (frame.active) {
+		frame_done(PROTO_FAILED, error);
+		return;
+	}
+	cout(data, sizeof(data));
+}
+
+/*
+ * Blocks from sequenced program commands are acknowledged as soon as they
+ * have been checked, then programmed a few words at a time while we wait for
+ * input, so that the next block arrives while this one is being written.
+ * A failure is remembered and reported on a later reply.  Words only go
+ * where erasing has finished, so a block may have to wait for it.
+ */
+#define COMMIT_STEP_WORDS	16
+
+static struct {
+	const uint32_t	*data;
+	unsigned	address;
+	unsigned	words;
+	bool		failed;
+} commit;
+
+static void
+commit_start(unsigned address, const uint32_t *data, unsigned words)
+{
+	commit.address = address;
+	commit.data = data;
+	commit.words = words;
+}
+
+/* returns true if it got anywhere */
+static bool
+commit_step(void)
+{
+	unsigned n = (commit.words < COMMIT_STEP_WORDS) ? commit.words : COMMIT_STEP_WORDS;
+	uint32_t start;
+
+	if (erase.busy || (commit.address >= erase.limit))
+		return false;
+	if ((commit.address + (n * 4)) > erase.limit)
+		n = (erase.limit - commit.address) / 4;
+	if (n == 0)
+		return false;
+
+	start = perf_cycles();
+	perf.words_programmed += n;
+	while (n--) {
+		flash_func_write_word(commit.address, *commit.data);
+		if (flash_func_read_word(commit.address) != *commit.data)
+			commit.failed = true;
+		commit.address += 4;
+		commit.data++;
+		commit.words--;
+	}
+	perf.program_cycles += perf_cycles() - start;
+	return true;
+}
+
+/* report a failure once */
+static bool
+commit_failed(void)
+{
+	bool failed = commit.failed;
+
+	commit.failed = false;
+	return failed;
+}
+
+/*
+ * Commands are taken in whole before anything is done with them, either in
+ * a frame or as far as the opcode and count say they run, so that once one
+ * has started nothing waits on the host.  The command handling then reads
+ * its arguments from the buffer.
+ */
+#define CMD_TIMEOUT		1000	/* ms allowed between pieces of an unframed command */
+#define CMD_QUIET		10	/* ms without input that ends a drain */
+
+enum cmd_state {
+	CMD_IDLE,			/* waiting for a command */
+	CMD_UNFRAMED,			/* taking in an unframed command */
+	CMD_FRAMED,			/* taking in a frame */
+	CMD_DRAIN			/* throwing input away until the host goes quiet */
+};
+
+static struct {
+	enum cmd_state	state;
+	bool		ready;			/* a whole command is waiting to be carried out */
+	uint8_t		buf[FRAME_IN_HEAD + PROTO_BULK_MAX + 8 + FRAME_TAIL];	/* the biggest command, in a frame */
+	unsigned	got;			/* bytes in buf */
+	unsigned	need;			/* bytes wanted in buf before looking again */
+	const uint8_t	*in;			/* command bytes not yet read */
+	unsigned	in_len;
+	bool		nak;			/* once drained, NAK a damaged frame */
+	uint8_t		error;			/* or else fail the command with this */
+} cmd;
+
+static void
+cmd_restart(void)
+{
+	cmd.state = CMD_IDLE;
+	cmd.got = 0;
+	cmd.need = 1;
+}
+
+static void
+cmd_ready(const uint8_t *in, unsigned len)
+{
+	cmd.in = in;
+	cmd.in_len = len;
+	cmd.ready = true;
+	cmd_restart();
+}
+
+/* throw input away until the host goes quiet, then NAK the frame or fail the command */
+static void
+cmd_drain(bool nak, uint8_t error)
+{
+	cmd.state = CMD_DRAIN;
+	cmd.nak = nak;
+	cmd.error = error;
+	timer[TIMER_CIN] = CMD_QUIET;
+}
+
+/*
+ * The length of an unframed command, from as much of it as has arrived, or 0
+ * if that is not enough to tell.  Anything unknown is just the opcode.
+ */
+static unsigned
+cmd_length(const uint8_t *buf, unsigned got)
+{
+	switch (buf[0]) {
+	case PROTO_GET_SYNC:
+	case PROTO_CHIP_ERASE:
+	case PROTO_LAZY_ERASE:
+	case PROTO_CHIP_VERIFY:
+	case PROTO_DEBUG:
+		return 2;		/* EOC */
+
+	case PROTO_GET_DEVICE:
+	case PROTO_READ_MULTI:
+	case PROTO_GET_SECTOR:
+	case PROTO_ERASE_SECTOR:
+		return 3;		/* arg/count, EOC */
+
+	case PROTO_READ_BULK:
+		return 4;		/* 16-bit count, EOC */
+
+	case PROTO_GET_CRC:
+	case PROTO_SET_ADDRESS:
+	case PROTO_SET_BAUD:
+		return 6;		/* 32-bit length/address/rate, EOC */
+
+	case PROTO_PROG_SKIP:
+		return 7;		/* sequence number, 32-bit count, EOC */
+
+	case PROTO_PROG_MULTI:
+		/* count, data, EOC */
+		return (got < 2) ? 0 : (3 + buf[1]);
+
+	case PROTO_PROG_SEQ:
+		/* sequence number, count, data, EOC */
+		return (got < 3) ? 0 : (4 + buf[2]);
+
+	case PROTO_PROG_BULK:
+	case PROTO_PROG_LZ4:
+		/* sequence number, 16-bit count, data, EOC */
+		return (got < 4) ? 0 : (5 + (buf[2] | (buf[3] << 8)));
+
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Take in whatever the host has sent, until a whole command is ready or it is
+ * clear that one won't be; returns true if anything happened.  With a
+ * deadline, a drain ends early once the bootloader's wait runs out.
+ */
+static bool
+cmd_receive(bool deadline)
+{
+	unsigned got, len;
+
+	if (cmd.state == CMD_DRAIN) {
+		got = cin_bulk(cmd.buf, sizeof(cmd.buf));
+		if (got) {
+			perf.bytes_received += got;
+			timer[TIMER_CIN] = CMD_QUIET;
+		}
+		if ((timer[TIMER_CIN] == 0) || (deadline && !timer[TIMER_BL_WAIT])) {
+			cmd_restart();
+			if (cmd.nak) {
+				frame_nak(PROTO_ERR_CRC);
+			} else {
+				failure_response(cmd.error);
+			}
+			return true;
+		}
+		return got != 0;
+	}
+
+	got = cin_bulk(cmd.buf + cmd.got, cmd.need - cmd.got);
+	if (got == 0) {
+		if ((cmd.state == CMD_IDLE) || (timer[TIMER_CIN] > 0))
+			return false;
+
+		if (cmd.state == CMD_FRAMED) {
+			// drop the rest of it, and any frames sent behind it (the
+			// host sends those again), so that none is taken for commands
+			cmd_drain(true, PROTO_ERR_CRC);
+		} else {
+			// what there is goes ahead, to be refused as short
+			cmd_ready(cmd.buf, cmd.got);
+		}
+		return true;
+	}
+	perf.bytes_received += got;
+	cmd.got += got;
+
+	switch (cmd.state) {
+	case CMD_IDLE:
+		// any frame before this has had its reply
+		led_on(LED_ACTIVITY);
+		frame.active = false;
+
+		if (cmd.buf[0] == PROTO_FRAME) {
+			cmd.state = CMD_FRAMED;
+			cmd.need = FRAME_IN_HEAD;
+			break;
+		}
+		if (frame.session) {
+			// the reply to the last frame is no longer to be trusted
+			frame.done = false;
+
+			// an unframed GET_SYNC after a quiet spell is some other tool
+			// starting afresh, so the session is over; anything else once
+			// the host has moved to frames is what is left of a frame whose
+			// marker was damaged, and it's dropped as above
+			if ((cmd.buf[0] == PROTO_GET_SYNC) && (timer[TIMER_CIN] == 0)) {
+				frame.session = false;
+			} else {
+				cmd_drain(true, PROTO_ERR_CRC);
+				return true;
+			}
+		}
+		cmd.state = CMD_UNFRAMED;
+		/* FALLTHROUGH */
+
+	case CMD_UNFRAMED:
+		// a count too big to take in is refused from what has come so far
+		len = cmd_length(cmd.buf, cmd.got);
+		if ((len != 0) && ((cmd.got >= len) || (len > sizeof(cmd.buf)))) {
+			cmd_ready(cmd.buf, cmd.got);
+			return true;
+		}
+		cmd.need = len ? len : (cmd.got + 1);
+		break;
+
+	case CMD_FRAMED:
+		// a frame is checked whole before anything is done with it
+		if (cmd.got == FRAME_IN_HEAD) {
+			len = cmd.buf[1] | (cmd.buf[2] << 8);
+			frame.seq = cmd.buf[3];
+
+			// a length we can't hold means a damaged header; the rest is noise
+			if ((len == 0) || (len > (sizeof(cmd.buf) - FRAME_IN_HEAD - FRAME_TAIL))) {
+				cmd_drain(true, PROTO_ERR_CRC);
+				return true;
+			}
+			cmd.need = FRAME_IN_HEAD + len + FRAME_TAIL;
+
+		} else if (cmd.got == cmd.need) {
+			len = cmd.got - FRAME_IN_HEAD - FRAME_TAIL;
+			if (crc16(0xffff, cmd.buf + 1, FRAME_IN_HEAD - 1 + len) !=
+			    (cmd.buf[cmd.got - 2] | (cmd.buf[cmd.got - 1] << 8))) {
+				cmd_drain(true, PROTO_ERR_CRC);
+				return true;
+			}
+			frame.active = true;
+			cmd_ready(cmd.buf + FRAME_IN_HEAD, len);
+			return true;
+		}
+		break;
+
+	case CMD_DRAIN:
+		break;
+	}
+
+	timer[TIMER_CIN] = (cmd.state == CMD_FRAMED) ? FRAME_TIMEOUT : CMD_TIMEOUT;
+	return true;
+}
+
+/* the next byte of the command, or -1 if there are no more */
+static int
+cmd_get(void)
+{
+	if (cmd.in_len == 0)
+		return -1;
+	cmd.in_len--;
+	return *cmd.in++;
+}
+
+static int
+cmd_get16(void)
+{
+	int lo, hi;
+
+	/* 16-bit values are sent little-endian */
+	lo = cmd_get();
+	if (lo < 0)
+		return -1;
+	hi = cmd_get();
+	if (hi < 0)
+		return -1;
+	return lo | (hi << 8);
+}
+
+static int
+cmd_get32(uint32_t *val)
+{
+	unsigned i;
+	int c;
+
+	/* 32-bit values are sent little-endian */
+	*val = 0;
+	for (i = 0; i < 32; i += 8) {
+		c = cmd_get();
+		if (c < 0)
+			return -1;
+		*val |= (uint32_t)c << i;
+	}
+	return 0;
+}
+
+/* the next len bytes of the command, where they lie, or NULL if there are too few */
+static const uint8_t *
+cmd_bytes(unsigned len)
+{
+	const uint8_t *p = cmd.in;
+
+	if (len > cmd.in_len)
+		return NULL;
+	cmd.in += len;
+	cmd.in_len -= len;
+	return p;
+}
+
+static void
+cout_word(uint32_t val)
+{
+	reply(&val, 4);
+}
+
+/*
+ * PROTO_DEBUG reply, little-endian:
+ *
+ *	version		uint32, PERF_VERSION
+ *	length		uint32, bytes that follow; later versions only append
+ *	cycle_hz	uint32, rate of the cycle counts
+ *	erase_cycles	uint64
+ *	program_cycles	uint64
+ *	wait_cycles	uint64
+ *	bytes_received	uint32
+ *	overflows	uint32, bytes lost by the interface
+ *	commands	uint32
+ *	sectors_erased	uint32
+ *	words_programmed uint32
+ *	boot_check_cycles uint32, time the last check of the application
+ *			descriptor took on the way to booting it (0 if there
+ *			has been none since reset, the image has no
+ *			descriptor, or the board can't time it)
+ */
+#define PERF_VERSION	1
+
+static void
+cout_word64(uint64_t val)
+{
+	cout_word((uint32_t)val);
+	cout_word((uint32_t)(val >> 32));
+}
+
+static void
+perf_report(void)
+{
+	cout_word(PERF_VERSION);
+	cout_word(4 + (3 * 8) + (6 * 4));
+	cout_word(board_info.systick_mhz * 1000000);
+	cout_word64(perf.erase_cycles);
+	cout_word64(perf.program_cycles);
+	cout_word64(perf.wait_cycles);
+	cout_word(perf.bytes_received);
+	cout_word(buf_overflows);
+	cout_word(perf.commands);
+	cout_word(perf.sectors_erased);
+	cout_word(perf.words_programmed);
+	cout_word(perf.boot_check_cycles);
+}
+
+static bool
+sector_blank(unsigned offset, unsigned size)
+{
+	unsigned address;
+
+	for (address = offset; address < (offset + size); address += 4)
+		if (flash_func_read_word(address) != 0xffffffff)
+			return false;
+	return true;
+}
+
+/*
+ * Move erasing along towards erase.target: notice when a sector has finished,
+ * or start on the next one, passing over any that are blank already unless
+ * erase.all is set.  Returns true if it got anywhere.
+ */
+static bool
+erase_step(void)
+{
+	unsigned sector, offset, size;
+
+	if (erase.busy)
+		return flash_erase_done();
+	if (erase.limit >= erase.target)
+		return false;
+
+	for (sector = 0, offset = 0; (size = flash_func_sector_size(sector)) != 0; sector++, offset += size)
+		if (erase.limit < (offset + size))
+			break;
+
+	if (size == 0) {
+		erase.limit = erase.target;
+	} else if (!erase.all && sector_blank(offset, size)) {
+		erase.limit = offset + size;
+	} else {
+		flash_erase(sector, offset + size);
+	}
+	return true;
+}
+
+/* nothing is being erased or programmed, or waiting to be */
+static bool
+flash_idle(void)
+{
+	return !erase.busy && (erase.limit >= erase.target) && (commit.words == 0);
+}
+
+/*
+ * Whether a command can be carried out yet.  A sequenced block only needs
+ * the one before it to have been programmed, so that the buffer is free;
+ * anything else must see flash as the host left it.
+ */
+static bool
+cmd_may_start(uint8_t c)
+{
+	switch (c) {
+	case PROTO_PROG_SEQ:
+	case PROTO_PROG_BULK:
+	case PROTO_PROG_LZ4:
+		return commit.words == 0;
+	default:
+		return flash_idle();
+	}
+}
+
+/* the start of the sector containing address */
+static unsigned
+sector_base(unsigned address)
+{
+	unsigned sector, offset, size;
+
+	for (sector = 0, offset = 0; (size = flash_func_sector_size(sector)) != 0; sector++, offset += size)
+		if (address < (offset + size))
+			break;
+	return offset;
+}
+
+/*
+ * A framed block up to half the sequence space behind the next one expected
+ * has been taken already, and is only being sent again.
+ */
+static bool
+seq_taken(uint8_t seq, uint8_t next_seq)
+{
+	return frame.active && ((uint8_t)(next_seq - seq - 1) < 128);
+}
+
+/* give up on a command, noting why for a framed reply */
+#define CMD_FAIL(e)	do { error = (e); goto cmd_fail; } while (0)
+#define CMD_BAD(e)	do { error = (e); goto cmd_bad; } while (0)
+
+void
+bootloader(unsigned timeout)
+{
+	int             c;
+	int		arg = 0;
+	unsigned	i;
+	unsigned	address = board_info.fw_size;	/* force erase before upload will work */
+	uint32_t	first_word = 0xffffffff;
+	uint8_t		seq = 0;
+	uint8_t		next_seq = 0;
+	uint32_t	length = 0;
+	unsigned	offset;
+	const uint8_t	*p;
+	bool		baud_pending = false;	/* line rate changed but not yet confirmed */
+	uint8_t		error = PROTO_ERR_NONE;
+	uint8_t		waiting = 0;		/* the command whose reply waits for the flash */
+	uint32_t	pass;
+	bool		busy;
+	static union {
+		uint8_t		c[PROTO_BULK_MAX];
+		uint32_t	w[PROTO_BULK_MAX / 4];
+	} flash_buffer;				/* programmed while the next block comes in */
+
+	/* (re)start the timer system */
+	systick_set_clocksource(STK_CTRL_CLKSOURCE_AHB);
+	systick_set_reload(board_info.systick_mhz * 1000);	/* 1ms tick, magic number */
+	systick_interrupt_enable();
+	systick_counter_enable();
+
+	/* if we are working with a timeout, start it running */
+	if (timeout)
+		timer[TIMER_BL_WAIT] = timeout;
+
+	// flash is left alone until the host asks for it to be erased
+	erase.limit = erase.target = board_info.fw_size;
+
+	// any frame seen before was from another session
+	frame.session = false;
+	frame.done = false;
+	cmd_restart();
+	cmd.ready = false;
+
+	/*
+	 * Each time round, move the flash along and take in whatever the host
+	 * has sent; once a whole command has arrived and the flash is ready for
+	 * it, carry it out.  Nothing here waits, so erasing and programming go
+	 * on while commands come in, and the CPU sleeps when there is nothing
+	 * to do.
+	 */
+	while (true) {
+		pass = perf_cycles();
+
+		// a framed command kept waiting by the flash is kept alive
+		frame.held = frame.active && (waiting || cmd.ready);
+		keepalive();
+
+		// programming comes first, as the host may be waiting on it
+		busy = commit_step() || erase_step();
+
+		// a reply that was waiting for the flash
+		if (waiting && flash_idle()) {
+			c = waiting;
+			waiting = 0;
+			if ((c == PROTO_PROG_MULTI) && commit_failed())
+				CMD_FAIL(PROTO_ERR_FLASH);
+			goto cmd_ok;
+		}
+
+		// take in the next command
+		if (!waiting && !cmd.ready) {
+			busy |= cmd_receive(timeout != 0);
+
+			if ((cmd.state == CMD_IDLE) && !cmd.ready) {
+				led_off(LED_ACTIVITY);
+
+				/* if we have a timeout and the timer has expired, return now */
+				if (timeout && !timer[TIMER_BL_WAIT])
+					return;
+
+				/* if the host never got through at a new line rate, go back */
+				if (baud_pending && !timer[TIMER_BAUD]) {
+					cset_baud(0);
+					baud_pending = false;
+				}
+			}
+		}
+
+		// nothing to do until the host or the flash gets further; the time
+		// counts as waiting for the host unless an erase is under way
+		if (!cmd.ready || !cmd_may_start(cmd.in[0])) {
+			if (!busy) {
+				cidle();
+				if (!erase.busy)
+					perf.wait_cycles += perf_cycles() - pass;
+			}
+			continue;
+		}
+		cmd.ready = false;
+
+		if (frame.active) {
+			// a retry because the reply went astray; send it again rather
+			// than doing the command twice, except that reads are repeated
+			if (frame.done && (frame.seq == frame.done_seq)) {
+				if (!frame.streamed) {
+					frame_reply();
+					continue;
+				}
+				address = frame.done_address;
+			}
+			frame.done_address = address;
+			frame.streamed = false;
+			frame.out_len = 0;
+		}
+		c = cmd_get();
+
+		// common argument handling for commands
+		switch (c) {
+		case PROTO_GET_SYNC:
+		case PROTO_CHIP_ERASE:
+		case PROTO_LAZY_ERASE:
+		case PROTO_CHIP_VERIFY:
+		case PROTO_DEBUG:
+			/* expect EOC */
+			if (cmd_get() != PROTO_EOC)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			break;
+
+		case PROTO_PROG_MULTI:
+			/* expect count */
+			arg = cmd_get();
+			if (arg < 0)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			break;
+
+		case PROTO_PROG_SEQ:
+			/* expect sequence number then count */
+			arg = cmd_get();
+			if (arg < 0)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			seq = arg;
+			arg = cmd_get();
+			if (arg < 0)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			break;
+
+		case PROTO_PROG_BULK:
+		case PROTO_PROG_LZ4:
+			/* expect sequence number then 16-bit count */
+			arg = cmd_get();
+			if (arg < 0)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			seq = arg;
+			arg = cmd_get16();
+			if (arg < 0)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			break;
+
+		case PROTO_GET_DEVICE:
+		case PROTO_READ_MULTI:
+		case PROTO_GET_SECTOR:
+		case PROTO_ERASE_SECTOR:
+			/* expect arg/count then EOC */
+			arg = cmd_get();
+			if (arg < 0)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			if (cmd_get() != PROTO_EOC)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			break;
+
+		case PROTO_READ_BULK:
+			/* expect 16-bit count then EOC */
+			arg = cmd_get16();
+			if (arg < 0)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			if (cmd_get() != PROTO_EOC)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			break;
+
+		case PROTO_GET_CRC:
+		case PROTO_SET_ADDRESS:
+		case PROTO_SET_BAUD:
+			/* expect 32-bit length/address/rate then EOC */
+			if (cmd_get32(&length) < 0)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			if (cmd_get() != PROTO_EOC)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			break;
+
+		case PROTO_PROG_SKIP:
+			/* expect sequence number, 32-bit count then EOC */
+			arg = cmd_get();
+			if (arg < 0)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			seq = arg;
+			if (cmd_get32(&length) < 0)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			if (cmd_get() != PROTO_EOC)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			break;
+		}
+
+		// handle the command byte
+		perf.commands++;
+		switch (c) {
+
+		case PROTO_GET_SYNC:            // sync
+			break;
+
+		case PROTO_GET_DEVICE:		// report board info
+
+			switch (arg) {
+			case PROTO_DEVICE_BL_REV:
+				reply(&bl_proto_rev, sizeof(bl_proto_rev));
+				break;
+
+			case PROTO_DEVICE_BOARD_ID:
+				reply(&board_info.board_type, sizeof(board_info.board_type));
+				break;
+
+			case PROTO_DEVICE_BOARD_REV:
+				reply(&board_info.board_rev, sizeof(board_info.board_rev));
+				break;
+
+			case PROTO_DEVICE_FW_SIZE:
+				reply(&board_info.fw_size, sizeof(board_info.fw_size));
+				break;
+
+			case PROTO_DEVICE_RX_WINDOW:
+				cout_word(cin_window());
+				break;
+
+			case PROTO_DEVICE_BULK_MAX:
+				cout_word(sizeof(flash_buffer.c));
+				break;
+
+			case PROTO_DEVICE_FEATURES:
+				cout_word(PROTO_FEATURES);
+				break;
+
+			default:
+				CMD_BAD(PROTO_ERR_COMMAND);
+			}
+			break;
+
+		case PROTO_CHIP_ERASE:          // erase the program area + read for programming
+			flash_unlock();
+			erase.limit = 0;
+			erase.target = board_info.fw_size;
+			erase.all = true;
+			address = 0;
+			next_seq = 0;
+			goto cmd_wait;
+
+		case PROTO_LAZY_ERASE:		// as above, but leave erasing until we get there
+			flash_unlock();
+			erase.limit = erase.target = 0;
+			erase.all = false;
+			address = 0;
+			next_seq = 0;
+			break;
+
+		case PROTO_GET_SECTOR:		// report sector size and CRC
+			// the sector just past the end reads as size 0, which ends the
+			// host's walk; any sector beyond that is out of range
+			for (i = 0, offset = 0; i < arg; i++) {
+				length = flash_func_sector_size(i);
+				if (length == 0)
+					CMD_FAIL(PROTO_ERR_ADDRESS);
+				offset += length;
+			}
+			length = flash_func_sector_size(arg);
+			cout_word(length);
+			cout_word(length ? crc_program_area(offset, length, first_word) : 0);
+			break;
+
+		case PROTO_ERASE_SECTOR:	// erase one sector
+			length = flash_func_sector_size(arg);
+			if (length == 0)
+				CMD_FAIL(PROTO_ERR_ADDRESS);
+			flash_unlock();
+			flash_erase(arg, erase.limit);	// which it leaves where it is
+
+			// a deferred first word is no longer valid once its sector is gone
+			if (arg == 0)
+				first_word = 0xffffffff;
+			goto cmd_wait;
+
+		case PROTO_SET_ADDRESS:		// move the program address
+			if (commit_failed())
+				CMD_FAIL(PROTO_ERR_FLASH);
+			if (length % 4)
+				CMD_FAIL(PROTO_ERR_LENGTH);
+			if (length > board_info.fw_size)
+				CMD_FAIL(PROTO_ERR_ADDRESS);
+			address = length;
+			next_seq = 0;
+
+			// skipping forward leaves the sectors passed over alone
+			if (sector_base(address) > erase.limit)
+				erase.limit = sector_base(address);
+			break;
+
+		case PROTO_SET_BAUD:		// change line rate
+			// answer at the old rate; the interface drains it before switching
+			timeout = 0;
+			sync_response();
+			if (cset_baud(length) == 0) {
+				baud_pending = true;
+				timer[TIMER_BAUD] = 1000;
+			}
+			continue;
+
+		case PROTO_CHIP_VERIFY:		// reset for verification of the program area
+			if (commit_failed())
+				CMD_FAIL(PROTO_ERR_FLASH);
+			address = 0;
+			break;
+
+		case PROTO_PROG_MULTI:		// program bytes
+		case PROTO_PROG_SEQ:		// program bytes, sequenced
+		case PROTO_PROG_BULK:		// program lots of bytes, sequenced
+		case PROTO_PROG_LZ4:		// program compressed bytes, sequenced
+			if (arg > sizeof(flash_buffer.c))
+				CMD_BAD(PROTO_ERR_LENGTH);
+			p = cmd_bytes(arg);
+			if (p == NULL)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			if (cmd_get() != PROTO_EOC)
+				CMD_BAD(PROTO_ERR_LENGTH);
+
+			// the last block has been programmed, so its buffer is free
+			if (c != PROTO_PROG_LZ4)
+				memcpy(flash_buffer.c, p, arg);
+			if (c != PROTO_PROG_MULTI) {
+				// the host may have more blocks in flight behind this one, so
+				// rather than hanging, refuse anything out of order or invalid
+				// and let it drain its window
+				reply(&seq, 1);
+				if (seq_taken(seq, next_seq))
+					goto cmd_ok;
+				if (seq != next_seq)
+					CMD_FAIL(PROTO_ERR_SEQUENCE);
+				if (c == PROTO_PROG_LZ4) {
+					arg = lz4_decode(p, arg, flash_buffer.c, sizeof(flash_buffer.c));
+					if (arg < 0)
+						CMD_FAIL(PROTO_ERR_DATA);
+				}
+				if (arg % 4)
+					CMD_FAIL(PROTO_ERR_LENGTH);
+				if ((address + arg) > board_info.fw_size)
+					CMD_FAIL(PROTO_ERR_ADDRESS);
+				next_seq++;
+			}
+			if (arg % 4)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			if ((address + arg) > board_info.fw_size)
+				CMD_BAD(PROTO_ERR_ADDRESS);
+
+			// the block is programmed once erasing has got past it
+			if ((address + arg) > erase.target)
+				erase.target = address + arg;
+			if (address == 0) {
+				// save the first word and don't program it until everything else is done
+				first_word = flash_buffer.w[0];
+				// replace first word with bits we can overwrite later
+				flash_buffer.w[0] = 0xffffffff;
+			}
+
+			// this is where any trouble with the last block gets reported
+			if (commit_failed())
+				CMD_FAIL(PROTO_ERR_FLASH);
+			commit_start(address, flash_buffer.w, arg / 4);
+			address += arg;
+
+			// unsequenced blocks are programmed before the reply, as they always were
+			if (c == PROTO_PROG_MULTI)
+				goto cmd_wait;
+			break;
+
+		case PROTO_PROG_SKIP:		// skip erased bytes, sequenced
+			reply(&seq, 1);
+			if (seq_taken(seq, next_seq))
+				goto cmd_ok;
+			if (seq != next_seq)
+				CMD_FAIL(PROTO_ERR_SEQUENCE);
+			if (commit_failed())
+				CMD_FAIL(PROTO_ERR_FLASH);
+			if (length % 4)
+				CMD_FAIL(PROTO_ERR_LENGTH);
+			if ((address + length) > board_info.fw_size)
+				CMD_FAIL(PROTO_ERR_ADDRESS);
+			next_seq++;
+
+			// the bytes skipped must still end up erased
+			if ((address + length) > erase.target)
+				erase.target = address + length;
+			if ((address == 0) && (length > 0))
+				first_word = 0xffffffff;
+			address += length;
+			break;
+
+		case PROTO_READ_MULTI:			// readback bytes
+		case PROTO_READ_BULK:			// readback lots of bytes
+			if (arg % 4)
+				CMD_BAD(PROTO_ERR_LENGTH);
+			if ((address + arg) > board_info.fw_size)
+				CMD_BAD(PROTO_ERR_ADDRESS);
+			reply_stream(arg);
+
+			// copy out through the flash buffer (idle, as nothing is being
+			// committed), so the interface gets whole ranges to send
+			while (arg > 0) {
+				offset = (arg > (int)sizeof(flash_buffer.c)) ? sizeof(flash_buffer.c) : (unsigned)arg;
+				for (i = 0; i < (offset / 4); i++)
+					flash_buffer.w[i] = flash_func_read_word(address + (i * 4));
+
+				// handle readback of the not-yet-programmed first word
+				if ((address == 0) && (first_word != 0xffffffff))
+					flash_buffer.w[0] = first_word;
+
+				reply(flash_buffer.c, offset);
+				address += offset;
+				arg -= offset;
+			}
+			break;
+
+		case PROTO_GET_CRC:			// checksum the program area
+			if (length % 4)
+				CMD_FAIL(PROTO_ERR_LENGTH);
+			if (length > board_info.fw_size)
+				CMD_FAIL(PROTO_ERR_ADDRESS);
+			cout_word(crc_program_area(0, length, first_word));
+			break;
+
+		case PROTO_BOOT:
+			// don't start an image that didn't program cleanly
+			if (commit_failed())
+				CMD_FAIL(PROTO_ERR_FLASH);
+
+			// program the deferred first word
+			if (first_word != 0xffffffff) {
+				flash_func_write_word(0, first_word);
+
+				// revert in case the flash was bad...
+				first_word = 0xffffffff;
+			}
+
+			// quiesce and jump to the app
+			return;
+
+		case PROTO_DEBUG:		// report performance counters
+			perf_report();
+			break;
+
+		default:
+			// a frame is whole, so there is nothing to skip before saying so
+			if (frame.active)
+				CMD_FAIL(PROTO_ERR_COMMAND);
+			continue;
+		}
+cmd_ok:
+		// we got a command worth syncing, so kill the timeout because
+		// we are probably talking to the uploader
+		timeout = 0;
+
+		// and if the line rate just changed, the host evidently has it right
+		baud_pending = false;
+
+		// send the sync response for this command
+		sync_response();
+		continue;
+cmd_fail:
+		// the command was well-formed but could not be carried out
+		timeout = 0;
+		baud_pending = false;
+		failure_response(error);
+		continue;
+cmd_wait:
+		// the reply goes once the flash has caught up (see above)
+		waiting = c;
+		continue;
+cmd_bad:
+		// Garbage straight after a line rate change most likely means
+		// the host couldn't follow; go back to the old rate and listen.
+		if (baud_pending) {
+			cset_baud(0);
+			baud_pending = false;
+			continue;
+		}
+
+		// Throw away the rest of the command so that none of it is taken
+		// for another, then say it was no good.  Let the initial delay keep
+		// counting down so that we ignore random chatter from a device.
+		cmd_drain(false, error);
+		continue;
+	}
+}
+#endif
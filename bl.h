@@ -22,22 +22,71 @@ extern struct boardinfo board_info;
 extern void jump_to_app(void);
 extern void bootloader(unsigned timeout);
 
+/*
+ * Boot mailbox, kept in a backup register that survives a reset.  The
+ * application may write one of these just before resetting the board; the
+ * bootloader clears it once read.
+ */
+#define BL_MAILBOX_BOOT_APP	0xb0070a99	/* boot the application without waiting */
+#define BL_MAILBOX_STAY		0xb0075a4b	/* stay in the bootloader until told to boot */
+
+/*
+ * Application descriptor: three words at APP_DESC_OFFSET into the image.  The
+ * application reserves them with the magic and zeroes, and px_mkfw.py fills
+ * in the length of the image and its CRC32 (as crc32_word(), leaving out the
+ * CRC word itself).  An image with a descriptor is only booted if it checks
+ * out; one without is booted unchecked, as before.
+ */
+#ifndef APP_DESC_OFFSET
+# define APP_DESC_OFFSET	0x200		/* past the largest vector table */
+#endif
+#define APP_DESC_MAGIC		0x44415850	/* "PXAD" */
+
 /* generic timers */
-#define NTIMERS		4
+#define NTIMERS		6
 #define TIMER_BL_WAIT	0
 #define TIMER_CIN	1
 #define TIMER_LED	2
 #define TIMER_DELAY	3
+#define TIMER_BAUD	4
+#define TIMER_KEEPALIVE	5
 extern volatile unsigned timer[NTIMERS];	/* each timer decrements every millisecond if > 0 */
+extern volatile unsigned systick_count;		/* milliseconds the timer system has been running */
 
-/* generic receive buffer for async reads */
+/* generic receive buffer for async reads; one producer (an interrupt), one consumer */
+#define RX_BUF_SIZE	256		/* must be a power of two */
 extern void buf_put(uint8_t b);
 extern int buf_get(void);
+extern unsigned buf_read(uint8_t *buf, unsigned len);	/* returns the number of bytes copied */
+extern bool buf_empty(void);
+extern unsigned buf_space(void);	/* bytes that can be put before it is full */
+extern volatile unsigned buf_overflows;	/* bytes dropped because the buffer was full */
+
+/* LZ4 block decoder; returns the decoded length or -1 if the block is bad */
+extern int lz4_decode(const uint8_t *src, unsigned srclen, uint8_t *dst, unsigned dstlen);
 
 /***************************************************************************** 
  * Chip/board functions.
  */
 
+/*
+ * Code that has to keep running while flash is being erased.  An F4 sector
+ * erase takes one to two seconds, and any fetch from flash meanwhile stalls
+ * until it is over, interrupts included; so this code goes in the .ramfunc
+ * section, which startup copies to RAM with .data, and the bootloader waits
+ * out each erase there rather than going back to flash.  The F1 builds the
+ * small protocol, which does nothing else while it erases, so nothing moves.
+ */
+#if defined(STM32F4)
+# define RAMFUNC		__attribute__((section(".ramfunc"), long_call))
+# define ERASE_WAIT_IN_RAM
+#else
+# define RAMFUNC
+#endif
+
+/* put the clocks back as they were at reset, just before starting the application */
+extern void board_deinit(void);
+
 /* LEDs */
 #define LED_ACTIVITY	1
 #define LED_BOOTLOADER	2
@@ -48,14 +97,27 @@ extern void led_toggle(unsigned led);
 
 /* flash helpers from main_*.c */
 extern unsigned flash_func_sector_size(unsigned sector);
-extern void flash_func_erase_sector(unsigned sector);
+extern void flash_func_erase_start(unsigned sector);	/* returns at once; see flash_func_busy() */
+extern bool flash_func_busy(void);	/* an erase is still under way */
 extern void flash_func_write_word(unsigned address, uint32_t word);
 extern uint32_t flash_func_read_word(unsigned address);
 
+/* free-running cycle counter for the performance counters, ticking at board_info.systick_mhz */
+extern uint32_t perf_cycles(void);
+
+/* CRC32 with STM32 CRC unit semantics, from main_*.c or crc32.c */
+extern void crc32_reset(void);
+extern uint32_t crc32_word(uint32_t word);	/* returns the CRC so far */
+extern uint32_t crc32_block(const uint32_t *words, unsigned count);	/* likewise */
+
 /*****************************************************************************
  * Interface in/output.
  */
 extern void cinit(void *config);
 extern void cfini(void);
 extern int cin(void);
+extern unsigned cin_bulk(uint8_t *buf, unsigned len);	/* as many bytes as are ready, up to len */
 extern void cout(uint8_t *buf, unsigned len);
+extern void cidle(void);		/* nothing to do; wait a while, or until input arrives */
+extern unsigned cin_window(void);	/* bytes that can arrive while we are busy without being lost */
+extern int cset_baud(uint32_t baud);	/* 0 restores the cinit() rate; returns -1 if not supported */
@@ -18,6 +18,7 @@
  */
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <libopencm3/stm32/f4/rcc.h>
 #include <libopencm3/stm32/f4/gpio.h>
 #include <libopencm3/stm32/f4/flash.h>
@@ -161,14 +162,107 @@ static const struct usb_config_descriptor config = {
 	.interface = ifaces,
 };
 
+/* the 96-bit unique device ID, so that each board enumerates with its own serial number */
+#define UID_BASE	0x1fff7a10
+#define UID_BYTES	12
+
+static char serial_number[(UID_BYTES * 2) + 1];
+
 static const char *usb_strings[] = {
 	"x",
 	"3D Robotics",
 	"PX4 Bootloader",
-	"PX4",
+	serial_number,
 };
 
-static int cdcacm_control_request(struct usb_setup_data *req, u8 **buf,
+static void
+serial_number_init(void)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	const uint8_t *uid = (const uint8_t *)UID_BASE;
+	unsigned i;
+
+	for (i = 0; i < UID_BYTES; i++) {
+		serial_number[i * 2] = hex[uid[i] >> 4];
+		serial_number[(i * 2) + 1] = hex[uid[i] & 0xf];
+	}
+	serial_number[UID_BYTES * 2] = '\0';
+}
+
+/*
+ * Replies are queued here and sent as full packets where possible, rather
+ * than one packet per cout() call.  The ring is filled from thread context
+ * and drained from the IN-complete callback; a partial packet goes out when
+ * the bootloader next looks for input, since by then its reply is complete.
+ *
+ * The interrupt handler, the endpoint callbacks and the transmit path run
+ * from RAM, as does the libopencm3 USB code under them (see stm32f4.ld), so
+ * that the host is still answered while flash is being erased.  Control
+ * requests other than the class ones here may still wait for the erase.
+ */
+#define TX_RING_SIZE	512		/* must be a power of two */
+#define TX_PACKET_SIZE	64
+
+static uint8_t tx_ring[TX_RING_SIZE];
+static volatile unsigned tx_head;	/* advanced by cout() */
+static volatile unsigned tx_tail;	/* advanced by tx_kick() */
+static volatile bool tx_busy;		/* a packet is in the endpoint */
+static volatile unsigned tx_last;	/* size of that packet */
+
+#define TX_PENDING()	((tx_head - tx_tail) & (TX_RING_SIZE - 1))
+
+/* start the next packet if the endpoint is idle; called with the OTG IRQ masked or from it */
+static RAMFUNC void
+tx_kick(void)
+{
+	uint8_t packet[TX_PACKET_SIZE];
+	unsigned len = TX_PENDING();
+	unsigned i;
+
+	if (tx_busy)
+		return;
+
+	if (len == 0) {
+		/* a full packet at the end of a transfer must be followed by a ZLP */
+		if (tx_last == TX_PACKET_SIZE) {
+			if (usbd_ep_write_packet(0x82, NULL, 0) == 0) {
+				tx_last = 0;
+				tx_busy = true;
+			}
+		}
+		return;
+	}
+
+	if (len > TX_PACKET_SIZE)
+		len = TX_PACKET_SIZE;
+	for (i = 0; i < len; i++)
+		packet[i] = tx_ring[(tx_tail + i) & (TX_RING_SIZE - 1)];
+
+	if (usbd_ep_write_packet(0x82, packet, len) == len) {
+		tx_tail = (tx_tail + len) & (TX_RING_SIZE - 1);
+		tx_last = len;
+		tx_busy = true;
+	}
+}
+
+/* as tx_kick(), from thread context */
+static RAMFUNC void
+tx_kick_thread(void)
+{
+	nvic_disable_irq(NVIC_OTG_FS_IRQ);
+	tx_kick();
+	nvic_enable_irq(NVIC_OTG_FS_IRQ);
+}
+
+static RAMFUNC void cdcacm_data_tx_cb(u8 ep)
+{
+	(void)ep;
+
+	tx_busy = false;
+	tx_kick();
+}
+
+static RAMFUNC int cdcacm_control_request(struct usb_setup_data *req, u8 **buf,
 		u16 *len, void (**complete)(struct usb_setup_data *req))
 {
 	(void)complete;
@@ -192,7 +286,14 @@ static int cdcacm_control_request(struct usb_setup_data *req, u8 **buf,
 	return 0;
 }
 
-static void cdcacm_data_rx_cb(u8 ep)
+/*
+ * The OUT endpoint is set to NAK while the receive buffer has no room for
+ * another packet, so the host holds off rather than having bytes dropped;
+ * rx_unblock() lets it go again once the bootloader has read some out.
+ */
+static volatile bool rx_blocked;
+
+static RAMFUNC void cdcacm_data_rx_cb(u8 ep)
 {
 	(void)ep;
 
@@ -202,14 +303,36 @@ static void cdcacm_data_rx_cb(u8 ep)
 
 	for (i = 0; i < len; i++)
 		buf_put(buf[i]);
+
+	if (buf_space() < 64) {
+		usbd_ep_nak_set(0x01, 1);
+		rx_blocked = true;
+	}
+}
+
+static void
+rx_unblock(void)
+{
+	if (!rx_blocked || (buf_space() < 64))
+		return;
+	nvic_disable_irq(NVIC_OTG_FS_IRQ);
+	rx_blocked = false;
+	usbd_ep_nak_set(0x01, 0);
+	nvic_enable_irq(NVIC_OTG_FS_IRQ);
 }
 
 static void cdcacm_set_config(u16 wValue)
 {
 	(void)wValue;
 
+	/* anything queued for a previous configuration is gone */
+	tx_head = tx_tail = 0;
+	tx_busy = false;
+	tx_last = 0;
+	rx_blocked = false;
+
 	usbd_ep_setup(0x01, USB_ENDPOINT_ATTR_BULK, 64, cdcacm_data_rx_cb);
-	usbd_ep_setup(0x82, USB_ENDPOINT_ATTR_BULK, 64, NULL);
+	usbd_ep_setup(0x82, USB_ENDPOINT_ATTR_BULK, 64, cdcacm_data_tx_cb);
 	usbd_ep_setup(0x83, USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
 
 	usbd_register_control_callback(
@@ -232,6 +355,7 @@ void cdc_init(void)
 	gpio_set_af(GPIOA, GPIO_AF10, GPIO9 | GPIO11 | GPIO12);
 #endif
 
+	serial_number_init();
 	usbd_init(&otgfs_usb_driver, &dev, &config, usb_strings);
 	usbd_register_set_config_callback(cdcacm_set_config);
 }
@@ -241,7 +365,7 @@ static void cdc_disconnect(void)
 	usbd_disconnect(true);
 }
 
-void
+RAMFUNC void
 otg_fs_isr(void)
 {
 	usbd_poll();
@@ -257,26 +381,89 @@ cinit(void *config)
 void
 cfini()
 {
+	unsigned spin = 1000000;
+
+	/* give the last reply a chance to reach the host before we go */
+	while ((TX_PENDING() || tx_busy || (tx_last == TX_PACKET_SIZE)) && spin--)
+		tx_kick_thread();
+
 	cdc_disconnect();
 	nvic_disable_irq(NVIC_OTG_FS_IRQ);
 }
 
+/* looking for input means any reply is complete, so send what is left */
+static RAMFUNC void
+tx_flush(void)
+{
+	if (!tx_busy && (TX_PENDING() || (tx_last == TX_PACKET_SIZE)))
+		tx_kick_thread();
+}
+
 int
 cin(void)
 {
-	return buf_get();
+	int c;
+
+	tx_flush();
+	c = buf_get();
+	rx_unblock();
+	return c;
 }
 
-void
-cout(uint8_t *buf, unsigned count)
+unsigned
+cin_bulk(uint8_t *buf, unsigned len)
 {
-	while (count) {
-		unsigned len = (count > 64) ? 64 : count;
-		unsigned sent;
+	unsigned got;
 
-		sent = usbd_ep_write_packet(0x82, buf, len);
+	tx_flush();
+	got = buf_read(buf, len);
+	rx_unblock();
+	return got;
+}
 
-		count -= sent;
-		buf += sent;
+RAMFUNC void
+cout(uint8_t *buf, unsigned count)
+{
+	while (count--) {
+		/* wait for the interrupt to make room */
+		while (TX_PENDING() == (TX_RING_SIZE - 1))
+			tx_kick_thread();
+
+		tx_ring[tx_head] = *buf++;
+		tx_head = (tx_head + 1) & (TX_RING_SIZE - 1);
 	}
+
+	/* don't wait for the reply to finish if there's a packet's worth already */
+	if (TX_PENDING() >= TX_PACKET_SIZE)
+		tx_kick_thread();
+}
+
+/*
+ * Sleep until the next interrupt, which is either a USB event or the systick.
+ * Interrupts are held off while the receive buffer is checked, so that a
+ * packet arriving just before the WFI still wakes it.
+ */
+RAMFUNC void
+cidle(void)
+{
+	tx_flush();
+
+	__asm__ volatile("cpsid i");
+	if (buf_empty())
+		__asm__ volatile("wfi");
+	__asm__ volatile("cpsie i");
+}
+
+unsigned
+cin_window(void)
+{
+	/* received packets are queued in the generic receive buffer, with the host held off when it fills */
+	return RX_BUF_SIZE - 1;
+}
+
+int
+cset_baud(uint32_t baud)
+{
+	/* the line rate means nothing to a CDC device */
+	return 0;
 }
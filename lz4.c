@@ -0,0 +1,71 @@
+/*
+ * LZ4 block decoder for compressed uploads.
+ *
+ * Blocks are decoded whole into RAM, so back-references can only reach data
+ * earlier in the same block; the window is therefore the block size and no
+ * extra history buffer is needed.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "bl.h"
+
+/* read an LZ4 extended length, returning false if the input runs out */
+static bool
+lz4_length(const uint8_t **src, const uint8_t *end, unsigned *len)
+{
+	uint8_t b;
+
+	do {
+		if (*src >= end)
+			return false;
+		b = *(*src)++;
+		*len += b;
+	} while (b == 255);
+	return true;
+}
+
+int
+lz4_decode(const uint8_t *src, unsigned srclen, uint8_t *dst, unsigned dstlen)
+{
+	const uint8_t *end = src + srclen;
+	unsigned out = 0;
+
+	while (src < end) {
+		unsigned token = *src++;
+		unsigned len = token >> 4;
+		unsigned offset;
+
+		/* literals */
+		if ((len == 15) && !lz4_length(&src, end, &len))
+			return -1;
+		if ((len > (unsigned)(end - src)) || (len > (dstlen - out)))
+			return -1;
+		while (len--)
+			dst[out++] = *src++;
+
+		/* the last sequence is literals only */
+		if (src == end)
+			break;
+
+		/* match; may overlap the output, so copy forwards a byte at a time */
+		if ((end - src) < 2)
+			return -1;
+		offset = src[0] | (src[1] << 8);
+		src += 2;
+		if ((offset == 0) || (offset > out))
+			return -1;
+		len = token & 15;
+		if ((len == 15) && !lz4_length(&src, end, &len))
+			return -1;
+		len += 4;
+		if (len > (dstlen - out))
+			return -1;
+		while (len--) {
+			dst[out] = dst[out - offset];
+			out++;
+		}
+	}
+	return out;
+}
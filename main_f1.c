@@ -50,6 +50,20 @@
 # error Unrecognised BOARD definition
 #endif
 
+/* the backup domain, for the boot mailbox in backup data registers 1 and 2 */
+#define BACKUP_PWR_CR		MMIO32(0x40007000)
+#define BACKUP_PWR_CR_DBP	(1 << 8)
+#define BACKUP_DR1		MMIO32(0x40006c00 + 0x04)
+#define BACKUP_DR2		MMIO32(0x40006c00 + 0x08)
+#ifndef RCC_CSR_IWDGRSTF
+# define RCC_CSR_IWDGRSTF	(1 << 29)
+# define RCC_CSR_WWDGRSTF	(1 << 30)
+#endif
+
+/* RCC values for board_deinit() */
+#define RCC_CFGR_SWS_MASK	(3 << 2)	/* system clock switch status; 0 is the HSI */
+#define RCC_AHBENR_RESET	0x00000014	/* SRAM and FLITF */
+
 #ifdef INTERFACE_USART
 # define BOARD_INTERFACE_CONFIG		(void *)BOARD_USART
 #else
@@ -106,6 +120,23 @@ board_init(void)
 
 }
 
+/*
+ * Put RCC back as it was at reset for the application: straight off the
+ * HSI, with the PLL stopped and only the reset peripheral clocks running.
+ */
+void
+board_deinit(void)
+{
+	RCC_CFGR = 0;
+	while (RCC_CFGR & RCC_CFGR_SWS_MASK)
+		;
+	RCC_CR &= ~RCC_CR_PLLON;
+
+	RCC_AHBENR = RCC_AHBENR_RESET;
+	RCC_APB1ENR = 0;
+	RCC_APB2ENR = 0;
+}
+
 unsigned
 flash_func_sector_size(unsigned sector)
 {
@@ -114,11 +145,31 @@ flash_func_sector_size(unsigned sector)
 	return 0;
 }
 
+/*
+ * As flash_erase_page(), but without waiting for the erase to finish;
+ * flash_func_busy() tidies up once it is done.
+ */
 void
-flash_func_erase_sector(unsigned sector)
+flash_func_erase_start(unsigned sector)
 {
-	if (sector < BOARD_FLASH_SECTORS)
-		flash_erase_page(APP_LOAD_ADDRESS + (sector + FLASH_SECTOR_SIZE));
+	if (sector >= BOARD_FLASH_SECTORS)
+		return;
+
+	flash_wait_for_last_operation();
+	FLASH_CR |= FLASH_PER;
+	FLASH_AR = APP_LOAD_ADDRESS + (sector * FLASH_SECTOR_SIZE);
+	FLASH_CR |= FLASH_STRT;
+}
+
+bool
+flash_func_busy(void)
+{
+	if (FLASH_SR & FLASH_BSY)
+		return true;
+
+	/* leave the controller ready to program */
+	FLASH_CR &= ~FLASH_PER;
+	return false;
 }
 
 void
@@ -133,6 +184,60 @@ flash_func_read_word(unsigned address)
 	return *(uint32_t *)(address + APP_LOAD_ADDRESS);
 }
 
+/*
+ * The M3 has a DWT cycle counter too, but SysTick is always running while
+ * the bootloader is; count its reloads and add the current value.
+ *
+ * SysTick is only started by bootloader(), so the check of the application
+ * made on the way to jump_to_app() can't be timed; there this returns 0 and
+ * the time comes out as 0, which the host takes as not measured.
+ */
+uint32_t
+perf_cycles(void)
+{
+	uint32_t reload = board_info.systick_mhz * 1000;
+	uint32_t ms, val;
+
+	if (!(STK_CTRL & STK_CTRL_ENABLE))
+		return 0;
+
+	/* a tick may land between the two reads */
+	do {
+		ms = systick_count;
+		val = STK_VAL;
+	} while (ms != systick_count);
+
+	return (ms * reload) + (reload - val);
+}
+
+/*
+ * Read and clear the boot mailbox (see bl.h); the backup registers are only
+ * 16 bits wide, so it is split across two of them, low half first.
+ *
+ * As on the F4, a watchdog reset reads as BL_MAILBOX_BOOT_APP, and the reset
+ * flags are left for the application.
+ */
+static uint32_t
+board_mailbox(void)
+{
+	uint32_t mailbox;
+
+	rcc_peripheral_enable_clock(&RCC_APB1ENR, RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN);
+	BACKUP_PWR_CR |= BACKUP_PWR_CR_DBP;
+
+	mailbox = (BACKUP_DR1 & 0xffff) | ((BACKUP_DR2 & 0xffff) << 16);
+	BACKUP_DR1 = 0;
+	BACKUP_DR2 = 0;
+
+	BACKUP_PWR_CR &= ~BACKUP_PWR_CR_DBP;
+	rcc_peripheral_disable_clock(&RCC_APB1ENR, RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN);
+
+	if ((mailbox == 0) && (RCC_CSR & (RCC_CSR_IWDGRSTF | RCC_CSR_WWDGRSTF)))
+		mailbox = BL_MAILBOX_BOOT_APP;
+
+	return mailbox;
+}
+
 void
 led_on(unsigned led)
 {
@@ -189,13 +294,28 @@ main(void)
 # error I2C bootloader detection logic not implemented
 #endif
 
+	/* the application may have left instructions before it reset */
+	switch (board_mailbox()) {
+	case BL_MAILBOX_BOOT_APP:
+		timeout = 0;
+		break;
+	case BL_MAILBOX_STAY:
+		timeout = 0xffffffff;
+		break;
+	}
+
 #ifdef BOARD_FORCE_BL_PIN
 	/* if the force-BL pin state matches the state of the pin, wait in the bootloader forever */
 	if (BOARD_FORCE_BL_VALUE == gpio_get(BOARD_FORCE_BL_PORT, BOARD_FORCE_BL_PIN))
 		timeout = 0xffffffff;
 #endif
 
-	/* XXX we could look at the backup SRAM to check for stay-in-bootloader instructions */
+	/*
+	 * Configure the clock for bootloader activity; as on the F4, this comes
+	 * first so that the application is checked at full speed, and
+	 * jump_to_app() puts the reset clock back (see board_deinit()).
+	 */
+	rcc_clock_setup_in_hsi_out_24mhz();
 
 	/* if we aren't expected to wait in the bootloader, try to boot immediately */
 	if (timeout == 0) {
@@ -206,9 +326,6 @@ main(void)
 		timeout = 0;
 	}
 
-	/* configure the clock for bootloader activity */
-	rcc_clock_setup_in_hsi_out_24mhz();
-
 	/* start the interface */
 	cinit(BOARD_INTERFACE_CONFIG);
 
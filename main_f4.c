@@ -7,6 +7,8 @@
 #include <libopencm3/stm32/f4/rcc.h>
 #include <libopencm3/stm32/f4/gpio.h>
 #include <libopencm3/stm32/f4/flash.h>
+#include <libopencm3/stm32/f4/scb.h>
+#include <libopencm3/stm32/crc.h>
 #include <libopencm3/stm32/usart.h>
 #include <libopencm3/stm32/systick.h>
 
@@ -32,6 +34,32 @@ static struct {
 };
 #define BOARD_FLASH_SECTORS (sizeof(flash_sectors) / sizeof(flash_sectors[0]))
 
+/* flash control fields that libopencm3 only sets inside its own routines */
+#define FLASH_CR_SNB_MASK	(0xf << 3)
+#define FLASH_CR_PSIZE_MASK	(3 << 8)
+#define FLASH_CR_PSIZE_X32	(2 << 8)
+
+/* the DWT cycle counter, which libopencm3 doesn't know about */
+#define DEMCR			MMIO32(0xe000edfc)
+#define DEMCR_TRCENA		(1 << 24)
+#define DWT_CTRL		MMIO32(0xe0001000)
+#define DWT_CTRL_CYCCNTENA	(1 << 0)
+#define DWT_CYCCNT		MMIO32(0xe0001004)
+
+/* the backup domain, for the boot mailbox in RTC backup register 0 */
+#define BACKUP_PWR_CR		MMIO32(0x40007000)
+#define BACKUP_PWR_CR_DBP	(1 << 8)
+#define BACKUP_MAILBOX		MMIO32(0x40002800 + 0x50)
+#ifndef RCC_CSR_IWDGRSTF
+# define RCC_CSR_IWDGRSTF	(1 << 29)
+# define RCC_CSR_WWDGRSTF	(1 << 30)
+#endif
+
+/* RCC values for board_deinit() */
+#define RCC_CFGR_SWS_MASK	(3 << 2)	/* system clock switch status; 0 is the HSI */
+#define RCC_PLLCFGR_RESET	0x24003010
+#define RCC_AHB1ENR_RESET	0x00100000	/* CCM data RAM */
+
 #ifdef BOARD_FMU
 # define BOARD_TYPE			5
 
@@ -152,6 +180,14 @@ board_init(void)
 		BOARD_PORT_LEDS,
 		BOARD_PIN_LED_BOOTLOADER | BOARD_PIN_LED_ACTIVITY);
 
+	/* enable the CRC unit */
+	rcc_peripheral_enable_clock(&RCC_AHB1ENR, RCC_AHB1ENR_CRCEN);
+
+	/* start the cycle counter for perf_cycles() */
+	DEMCR |= DEMCR_TRCENA;
+	DWT_CYCCNT = 0;
+	DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+
 #ifdef INTERFACE_USART
 	/* configure usart pins */
 	rcc_peripheral_enable_clock(&BOARD_USART_PIN_CLOCK_REGISTER, BOARD_USART_PIN_CLOCK_BIT);
@@ -164,6 +200,31 @@ board_init(void)
 
 }
 
+/*
+ * Put RCC back as it was at reset for the application: back onto the HSI,
+ * with the PLL and HSE stopped, no flash wait states, and only the reset
+ * peripheral clocks running.  The flash is slowed down last, once the clock
+ * it has to keep up with is.
+ */
+void
+board_deinit(void)
+{
+	RCC_CR |= RCC_CR_HSION;
+	while (!(RCC_CR & RCC_CR_HSIRDY))
+		;
+	RCC_CFGR = 0;
+	while (RCC_CFGR & RCC_CFGR_SWS_MASK)
+		;
+	RCC_CR &= ~(RCC_CR_PLLON | RCC_CR_HSEON);
+	RCC_PLLCFGR = RCC_PLLCFGR_RESET;
+	FLASH_ACR = 0;
+
+	RCC_AHB1ENR = RCC_AHB1ENR_RESET;
+	RCC_AHB2ENR = 0;
+	RCC_APB1ENR = 0;
+	RCC_APB2ENR = 0;
+}
+
 
 unsigned
 flash_func_sector_size(unsigned sector)
@@ -173,11 +234,34 @@ flash_func_sector_size(unsigned sector)
 	return 0;
 }
 
-void
-flash_func_erase_sector(unsigned sector)
+/*
+ * libopencm3's flash_erase_sector() waits for the erase to finish, so the
+ * erase is started here by hand and left running; flash_func_busy() tidies
+ * up once it is done.  Both run from RAM, as nothing in flash can be reached
+ * until then.
+ */
+RAMFUNC void
+flash_func_erase_start(unsigned sector)
 {
-	if (sector < BOARD_FLASH_SECTORS)
-		flash_erase_sector(flash_sectors[sector].erase_code, FLASH_PROGRAM_X32);
+	if (sector >= BOARD_FLASH_SECTORS)
+		return;
+
+	while (FLASH_SR & FLASH_BSY)
+		;
+	FLASH_CR = (FLASH_CR & ~(FLASH_CR_SNB_MASK | FLASH_CR_PSIZE_MASK)) |
+		   FLASH_CR_PSIZE_X32 | flash_sectors[sector].erase_code | FLASH_SER;
+	FLASH_CR |= FLASH_STRT;
+}
+
+RAMFUNC bool
+flash_func_busy(void)
+{
+	if (FLASH_SR & FLASH_BSY)
+		return true;
+
+	/* leave the controller ready to program */
+	FLASH_CR &= ~(FLASH_SER | FLASH_CR_SNB_MASK);
+	return false;
 }
 
 void
@@ -192,6 +276,61 @@ flash_func_read_word(unsigned address)
 	return *(uint32_t *)(address + APP_LOAD_ADDRESS);
 }
 
+RAMFUNC uint32_t
+perf_cycles(void)
+{
+	return DWT_CYCCNT;
+}
+
+/*
+ * Read and clear the boot mailbox (see bl.h).
+ *
+ * A watchdog reset reads as BL_MAILBOX_BOOT_APP, since the application is
+ * better placed to recover than a bootloader waiting for a host.  The reset
+ * flags are only read: the application looks at them too, to tell a restart
+ * in flight from a power-up, and clears them itself.
+ */
+static uint32_t
+board_mailbox(void)
+{
+	uint32_t mailbox;
+
+	rcc_peripheral_enable_clock(&RCC_APB1ENR, RCC_APB1ENR_PWREN);
+	BACKUP_PWR_CR |= BACKUP_PWR_CR_DBP;
+
+	mailbox = BACKUP_MAILBOX;
+	BACKUP_MAILBOX = 0;
+
+	BACKUP_PWR_CR &= ~BACKUP_PWR_CR_DBP;
+	rcc_peripheral_disable_clock(&RCC_APB1ENR, RCC_APB1ENR_PWREN);
+
+	if ((mailbox == 0) && (RCC_CSR & (RCC_CSR_IWDGRSTF | RCC_CSR_WWDGRSTF)))
+		mailbox = BL_MAILBOX_BOOT_APP;
+
+	return mailbox;
+}
+
+void
+crc32_reset(void)
+{
+	CRC_CR = CRC_CR_RESET;
+}
+
+uint32_t
+crc32_word(uint32_t word)
+{
+	CRC_DR = word;
+	return CRC_DR;
+}
+
+uint32_t
+crc32_block(const uint32_t *words, unsigned count)
+{
+	while (count--)
+		CRC_DR = *words++;
+	return CRC_DR;
+}
+
 void
 led_on(unsigned led)
 {
@@ -218,19 +357,41 @@ led_off(unsigned led)
 	}
 }
 
-void
+/* called from the systick handler, so by hand rather than with gpio_toggle() from flash */
+RAMFUNC void
 led_toggle(unsigned led)
 {
 	switch (led) {
 	case LED_ACTIVITY:
-		gpio_toggle(BOARD_PORT_LEDS, BOARD_PIN_LED_ACTIVITY);
+		GPIO_ODR(BOARD_PORT_LEDS) ^= BOARD_PIN_LED_ACTIVITY;
 		break;
 	case LED_BOOTLOADER:
-		gpio_toggle(BOARD_PORT_LEDS, BOARD_PIN_LED_BOOTLOADER);
+		GPIO_ODR(BOARD_PORT_LEDS) ^= BOARD_PIN_LED_BOOTLOADER;
 		break;
 	}
 }
 
+/*
+ * Take interrupts through a copy of the vector table in RAM, since fetching a
+ * vector from flash stalls while it is being erased (see RAMFUNC in bl.h).
+ * VTOR wants the table aligned to its size rounded up to a power of two; the
+ * F4 has 98 vectors.
+ */
+#define RAM_VECTORS	128
+
+static uint32_t ram_vectors[RAM_VECTORS] __attribute__((aligned(RAM_VECTORS * 4)));
+extern uint32_t _vectors[], _evectors[];	/* from the linker script */
+
+static void
+vectors_to_ram(void)
+{
+	unsigned i;
+
+	for (i = 0; (i < RAM_VECTORS) && (&_vectors[i] < _evectors); i++)
+		ram_vectors[i] = _vectors[i];
+	SCB_VTOR = (uint32_t)ram_vectors;
+}
+
 /* we should know this, but we don't */
 #ifndef SCB_CPACR
 # define SCB_CPACR (*((volatile uint32_t *) (((0xE000E000UL) + 0x0D00UL) + 0x088)))
@@ -265,7 +426,24 @@ main(void)
 	timeout = 0;
 #endif
 
-	/* XXX we could look at the backup SRAM to check for stay-in-bootloader instructions */
+	/* the application may have left instructions before it reset */
+	switch (board_mailbox()) {
+	case BL_MAILBOX_BOOT_APP:
+		timeout = 0;
+		break;
+	case BL_MAILBOX_STAY:
+		timeout = 0xffffffff;
+		break;
+	}
+
+	/*
+	 * Configure the clock for bootloader activity.  This comes before any
+	 * attempt to boot, so that the application is checked at full speed:
+	 * about 9ms for a 1MB image, against over 100ms on the reset clock.
+	 * jump_to_app() puts the reset clock back before starting it (see
+	 * board_deinit()).
+	 */
+	rcc_clock_setup_hse_3v3(&clock_setup);
 
 	/* if we aren't expected to wait in the bootloader, try to boot immediately */
 	if (timeout == 0) {
@@ -275,9 +453,6 @@ main(void)
 		/* if we returned, there is no app; go to the bootloader and stay there */
 		timeout = 0;
 	}
-
-	/* configure the clock for bootloader activity */
-	rcc_clock_setup_hse_3v3(&clock_setup);
 #if 0
 	// MCO1/02
 	gpio_mode_setup(GPIOA, GPIO_MODE_AF, GPIO_PUPD_NONE, GPIO8);
@@ -286,6 +461,9 @@ main(void)
 	gpio_mode_setup(GPIOC, GPIO_MODE_AF, GPIO_PUPD_NONE, GPIO9);
 	gpio_set_af(GPIOC, GPIO_AF0, GPIO9);
 #endif
+	/* interrupts from here on must not depend on flash */
+	vectors_to_ram();
+
 	/* start the interface */
 	cinit(BOARD_INTERFACE_CONFIG);
 
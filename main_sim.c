@@ -0,0 +1,434 @@
+/*
+ * Host simulator board support for the bootloader.
+ *
+ * Runs the common bootloader logic as a Linux process so that the protocol
+ * and the uploader can be exercised and timed without hardware.
+ *
+ *  - flash is a file mapped at APP_LOAD_ADDRESS, with a configurable sector
+ *    map and a simple erase/program timing model
+ *  - the host interface is a pseudo-terminal (see pty.c)
+ *  - the millisecond timers are driven from a host clock thread
+ *
+ * usage: px4sim_bl.elf [-f flashfile] [-s sectors] [-e usec/KB] [-w usec/word]
+ *                      [-p ptylink] [-k baud | -u] [-t timeout_ms] [-b board_id]
+ *                      [-r board_rev] [-n bytes] [-l]
+ *
+ * The sector map is a comma-separated list of sector sizes in KiB, where
+ * <size>x<count> repeats a size; the default matches the STM32F4 boards.
+ *
+ * By default the pty moves data as fast as the host can; -k paces it like a
+ * UART at the given rate (which SET_BAUD then changes), and -u like a
+ * full-speed USB link.  -n flips a bit in about one byte in every so many,
+ * in both directions, like a noisy line.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "sim.h"
+#include "bl.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+# define MAP_FIXED_NOREPLACE	MAP_FIXED
+#endif
+
+#define SIM_MAX_SECTORS		128
+
+/* flash parameters, settable from the command line */
+static struct {
+	unsigned	offset;
+	unsigned	size;
+} flash_sectors[SIM_MAX_SECTORS];
+static unsigned		flash_sector_count;
+
+static const char	*flash_file = "px4sim_flash.bin";
+static const char	*sector_map = "16,16,16,64,128x7";
+static unsigned		erase_usec_per_kb = 8000;	/* ~1s for a 128K sector */
+static unsigned		program_usec_per_word = 16;
+static uint8_t		*flash_base;
+static struct timespec	flash_ready;			/* time the flash controller goes idle */
+
+static struct sim_link	host_link;
+static bool		loop_on_boot;
+static sigjmp_buf	reset_env;
+
+static volatile bool	systick_enabled;
+static volatile unsigned leds;
+
+volatile uint32_t	sim_vtor;
+
+/* board definition */
+struct boardinfo board_info = {
+	.board_type	= 5,
+	.board_rev	= 0,
+	.fw_size	= APP_SIZE_MAX,
+
+	.systick_mhz	= 1,
+};
+
+static void
+timespec_add_usec(struct timespec *ts, unsigned long usec)
+{
+	ts->tv_sec += usec / 1000000;
+	ts->tv_nsec += (usec % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static bool
+timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec < b->tv_sec) || ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec));
+}
+
+/*
+ * Account for time some piece of hardware is busy, given the time it next
+ * goes idle.
+ *
+ * Many operations are far shorter than the host can usefully sleep, so busy
+ * time is accumulated and only slept off once it runs more than slack
+ * microseconds ahead of the host clock.
+ */
+void
+sim_busy(struct timespec *ready, unsigned long usec, unsigned long slack)
+{
+	struct timespec now, limit;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespec_before(ready, &now))
+		*ready = now;
+	timespec_add_usec(ready, usec);
+
+	limit = now;
+	timespec_add_usec(&limit, slack);
+	if (timespec_before(&limit, ready))
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, ready, NULL) == EINTR)
+			;
+}
+
+static void
+flash_busy(unsigned long usec)
+{
+	sim_busy(&flash_ready, usec, 1000);
+}
+
+static void
+flash_init(void)
+{
+	const char *p = sector_map;
+	unsigned offset = 0;
+	int fd;
+
+	/* parse the sector map */
+	while (*p) {
+		char *end;
+		unsigned size = strtoul(p, &end, 0);
+		unsigned count = 1;
+
+		if (*end == 'x')
+			count = strtoul(end + 1, &end, 0);
+		if ((end == p) || (size == 0) || ((*end != ',') && (*end != '\0'))) {
+			fprintf(stderr, "sim: bad sector map '%s'\n", sector_map);
+			exit(1);
+		}
+		while (count--) {
+			if (flash_sector_count == SIM_MAX_SECTORS) {
+				fprintf(stderr, "sim: too many sectors\n");
+				exit(1);
+			}
+			flash_sectors[flash_sector_count].offset = offset;
+			flash_sectors[flash_sector_count].size = size * 1024;
+			flash_sector_count++;
+			offset += size * 1024;
+		}
+		p = (*end == ',') ? end + 1 : end;
+	}
+	board_info.fw_size = offset;
+
+	/* map the backing file where the real flash would be, blank-filling any new space */
+	fd = open(flash_file, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		perror(flash_file);
+		exit(1);
+	}
+	off_t length = lseek(fd, 0, SEEK_END);
+	if (length < (off_t)offset) {
+		static const uint8_t blank[1024] = { [0 ... 1023] = 0xff };
+
+		while (length < (off_t)offset) {
+			size_t len = offset - length;
+			if (len > sizeof(blank))
+				len = sizeof(blank);
+			if (pwrite(fd, blank, len, length) != (ssize_t)len) {
+				perror(flash_file);
+				exit(1);
+			}
+			length += len;
+		}
+	}
+	flash_base = mmap((void *)APP_LOAD_ADDRESS, offset, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+	if (flash_base != (uint8_t *)APP_LOAD_ADDRESS) {
+		fprintf(stderr, "sim: cannot map flash at 0x%lx\n", (unsigned long)APP_LOAD_ADDRESS);
+		exit(1);
+	}
+	close(fd);
+}
+
+unsigned
+flash_func_sector_size(unsigned sector)
+{
+	if (sector < flash_sector_count)
+		return flash_sectors[sector].size;
+	return 0;
+}
+
+/*
+ * The sector is blanked at once, but the controller stays busy for as long
+ * as a real erase would take; programming meanwhile waits for it.
+ */
+void
+flash_func_erase_start(unsigned sector)
+{
+	struct timespec now;
+
+	if (sector < flash_sector_count) {
+		memset(flash_base + flash_sectors[sector].offset, 0xff, flash_sectors[sector].size);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_before(&flash_ready, &now))
+			flash_ready = now;
+		timespec_add_usec(&flash_ready, (unsigned long)erase_usec_per_kb * (flash_sectors[sector].size / 1024));
+	}
+}
+
+bool
+flash_func_busy(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_before(&now, &flash_ready);
+}
+
+void
+flash_func_write_word(unsigned address, uint32_t word)
+{
+	if ((address % 4) || (address + 4) > board_info.fw_size)
+		return;
+
+	/* like NOR flash, programming can only clear bits */
+	*(uint32_t *)(flash_base + address) &= word;
+	flash_busy(program_usec_per_word);
+}
+
+uint32_t
+flash_func_read_word(unsigned address)
+{
+	return *(uint32_t *)(flash_base + address);
+}
+
+void
+flash_lock(void)
+{
+}
+
+void
+board_deinit(void)
+{
+}
+
+void
+flash_unlock(void)
+{
+}
+
+uint32_t
+perf_cycles(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec * 1000000ULL) + (now.tv_nsec / 1000)) * board_info.systick_mhz;
+}
+
+void
+led_on(unsigned led)
+{
+	leds |= led;
+}
+
+void
+led_off(unsigned led)
+{
+	leds &= ~led;
+}
+
+void
+led_toggle(unsigned led)
+{
+	leds ^= led;
+}
+
+/*
+ * The systick is emulated by a thread that calls the handler once per
+ * millisecond while the counter and interrupt are both enabled.
+ */
+static void *
+systick_thread(void *arg)
+{
+	struct timespec next;
+
+	(void)arg;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (;;) {
+		timespec_add_usec(&next, 1000);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+			;
+		if (systick_enabled)
+			sys_tick_handler();
+	}
+	return NULL;
+}
+
+void
+systick_set_clocksource(uint8_t clocksource)
+{
+	(void)clocksource;
+}
+
+void
+systick_set_reload(uint32_t value)
+{
+	(void)value;
+}
+
+void
+systick_interrupt_enable(void)
+{
+	systick_enabled = true;
+}
+
+void
+systick_interrupt_disable(void)
+{
+	systick_enabled = false;
+}
+
+void
+systick_counter_enable(void)
+{
+}
+
+void
+systick_counter_disable(void)
+{
+}
+
+void
+sim_boot(uint32_t stacktop, uint32_t entrypoint)
+{
+	printf("sim: booting application, stack 0x%08x entry 0x%08x\n", stacktop, entrypoint);
+	fflush(stdout);
+
+	if (loop_on_boot)
+		siglongjmp(reset_env, 1);
+	exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned timeout = BOOTLOADER_DELAY;
+	pthread_t tick;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "f:s:e:w:p:k:ut:b:r:n:l")) != -1) {
+		switch (ch) {
+		case 'f':
+			flash_file = optarg;
+			break;
+		case 's':
+			sector_map = optarg;
+			break;
+		case 'e':
+			erase_usec_per_kb = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			program_usec_per_word = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			host_link.path = optarg;
+			break;
+		case 'k':
+			host_link.baud = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			host_link.usb = true;
+			break;
+		case 't':
+			timeout = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			board_info.board_type = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			board_info.board_rev = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			host_link.noise = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			loop_on_boot = true;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-f flashfile] [-s sectors] [-e usec/KB] [-w usec/word]\n"
+				"       [-p ptylink] [-k baud | -u] [-t timeout_ms] [-b board_id]\n"
+				"       [-r board_rev] [-n bytes] [-l]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	/* do board-specific initialisation */
+	flash_init();
+	pthread_create(&tick, NULL, systick_thread, NULL);
+
+	/* every boot after the application "runs" comes back here */
+	if (sigsetjmp(reset_env, 0))
+		timeout = BOOTLOADER_DELAY;
+
+	/* if we aren't expected to wait in the bootloader, try to boot immediately */
+	if (timeout == 0) {
+		/* try to boot immediately */
+		jump_to_app();
+
+		/* if we returned, there is no app; go to the bootloader and stay there */
+		timeout = 0;
+	}
+
+	/* start the interface */
+	cinit((void *)&host_link);
+
+	while (1)
+	{
+		/* run the bootloader, possibly coming back after the timeout */
+		bootloader(timeout);
+
+		/* look to see if we can boot the app */
+		jump_to_app();
+
+		/* boot failed; stay in the bootloader forever next time */
+		timeout = 0;
+	}
+}
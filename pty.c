@@ -0,0 +1,240 @@
+/*
+ * Pseudo-terminal interface for the host simulator.
+ *
+ * The slave side of the pty is what the uploader opens; its name is printed at
+ * startup, and optionally symlinked to the path given in the interface config.
+ *
+ * The link can also be paced, so that uploads take about as long as they
+ * would over a real one: as a UART at the current line rate (ten bit times a
+ * byte), or as full-speed USB, where replies also wait for the next 1ms frame.
+ * It can be made noisy too, damaging the odd byte each way.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "bl.h"
+
+#define USB_FS_BYTES_PER_SEC	(19 * 64 * 1000)	/* 19 bulk packets per frame */
+
+static int		master = -1;
+static int		slave = -1;
+static const char	*link_path;
+static uint32_t		line_baud;
+static uint32_t		default_baud;
+static bool		link_usb;
+static unsigned		link_noise;
+static unsigned		noise_seed = 1;		/* the same damage every run */
+static struct timespec	rx_ready;
+static struct timespec	tx_ready;
+
+/* microseconds to move len bytes over the link, 0 if it is not paced */
+static unsigned long
+link_usec(unsigned len)
+{
+	if (link_usb)
+		return (len * 1000000ULL) / USB_FS_BYTES_PER_SEC;
+	if (line_baud)
+		return (len * 10 * 1000000ULL) / line_baud;
+	return 0;
+}
+
+/* flip a bit in about one byte in link_noise */
+static void
+add_noise(uint8_t *buf, unsigned len)
+{
+	while (len--) {
+		if ((rand_r(&noise_seed) % link_noise) == 0)
+			*buf ^= 1 << (rand_r(&noise_seed) % 8);
+		buf++;
+	}
+}
+
+/* received bytes are held back until they could have arrived */
+static void
+rx_pace(unsigned len)
+{
+	unsigned long usec = link_usec(len);
+
+	if (usec)
+		sim_busy(&rx_ready, usec, 1000);
+}
+
+/* a reply goes out only once it would have been sent */
+static void
+tx_pace(unsigned len)
+{
+	unsigned long usec = link_usec(len);
+	struct timespec now;
+
+	if (!usec)
+		return;
+	if (link_usb) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		usec += 1000 - ((now.tv_nsec / 1000) % 1000);
+	}
+	sim_busy(&tx_ready, usec, 0);
+}
+
+void
+cinit(void *config)
+{
+	const struct sim_link *host_link = (const struct sim_link *)config;
+	struct termios t;
+	const char *name;
+
+	link_path = host_link->path;
+	line_baud = default_baud = host_link->baud;
+	link_usb = host_link->usb;
+	link_noise = host_link->noise;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if ((master < 0) || grantpt(master) || unlockpt(master) || !(name = ptsname(master))) {
+		perror("sim: pty");
+		exit(1);
+	}
+
+	/*
+	 * Hold the slave open ourselves so that the master does not see a hangup
+	 * each time the uploader closes the port, and put it in raw mode so nothing
+	 * is mangled before the uploader configures it.
+	 */
+	slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave < 0) {
+		perror(name);
+		exit(1);
+	}
+	tcgetattr(slave, &t);
+	cfmakeraw(&t);
+	tcsetattr(slave, TCSANOW, &t);
+
+	fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+	if (link_path) {
+		unlink(link_path);
+		if (symlink(name, link_path)) {
+			perror(link_path);
+			exit(1);
+		}
+	}
+	printf("sim: bootloader on %s\n", link_path ? link_path : name);
+	fflush(stdout);
+}
+
+void
+cfini(void)
+{
+	if (link_path)
+		unlink(link_path);
+	close(slave);
+	close(master);
+	master = slave = -1;
+}
+
+int
+cin(void)
+{
+	uint8_t c;
+
+	if (read(master, &c, 1) == 1) {
+		rx_pace(1);
+		if (link_noise)
+			add_noise(&c, 1);
+		return c;
+	}
+	return -1;
+}
+
+unsigned
+cin_bulk(uint8_t *buf, unsigned len)
+{
+	ssize_t got;
+
+	got = read(master, buf, len);
+	if (got <= 0)
+		return 0;
+	rx_pace(got);
+	if (link_noise)
+		add_noise(buf, got);
+	return got;
+}
+
+static void
+tx_write(const uint8_t *buf, unsigned len)
+{
+	struct pollfd pfd = { .fd = master, .events = POLLOUT };
+
+	while (len) {
+		ssize_t sent = write(master, buf, len);
+
+		if (sent > 0) {
+			buf += sent;
+			len -= sent;
+		} else if ((sent < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+			return;
+		} else {
+			poll(&pfd, 1, 10);
+		}
+	}
+}
+
+void
+cout(uint8_t *buf, unsigned len)
+{
+	uint8_t noisy[256];
+	unsigned n;
+
+	tx_pace(len);
+	if (!link_noise) {
+		tx_write(buf, len);
+		return;
+	}
+
+	/* the caller's copy is left alone, as it may be sent again */
+	while (len) {
+		n = (len < sizeof(noisy)) ? len : sizeof(noisy);
+		memcpy(noisy, buf, n);
+		add_noise(noisy, n);
+		tx_write(noisy, n);
+		buf += n;
+		len -= n;
+	}
+}
+
+/*
+ * Rather than spinning like the hardware does, wait briefly for data; this
+ * returns as soon as a byte arrives, but keeps idle simulators cheap.
+ */
+void
+cidle(void)
+{
+	struct pollfd pfd = { .fd = master, .events = POLLIN };
+
+	poll(&pfd, 1, 1);
+}
+
+unsigned
+cin_window(void)
+{
+	/* the pty never drops data, but behave like the USB boards do */
+	return RX_BUF_SIZE - 1;
+}
+
+int
+cset_baud(uint32_t baud)
+{
+	/* USB has no line rate; otherwise it sets the pace, if there is one */
+	if (link_usb || !default_baud)
+		return 0;
+	line_baud = baud ? baud : default_baud;
+	return 0;
+}
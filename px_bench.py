@@ -0,0 +1,232 @@
+#!/usr/bin/env python
+#
+# Upload benchmark for the PX4 bootloader
+#
+# Runs px_uploader.py against the host simulator (make sim) over a pty, and
+# times each upload.  Image size, chunk size, link speed and erase strategy are
+# swept one at a time around a reference case, so that every axis is covered
+# without running the whole cross product; --matrix runs that instead.
+#
+# Results are written as CSV and JSON in case order.  With --baseline, any
+# case whose throughput has fallen more than --tolerance below the stored
+# figure fails the run; --update-baseline stores the new figures instead.
+#
+# Images are generated from a fixed seed, so every run uploads the same bytes.
+#
+
+import sys
+import os
+import argparse
+import json
+import hashlib
+import itertools
+import shutil
+import subprocess
+import tempfile
+import time
+
+# the sweep; the first entry of each axis is the reference
+SIZES		= [256, 64, 128, 512, 960]		# KiB; the simulator has 1008KiB of application flash
+CHUNKS		= [4096, 256, 1024]
+LINKS		= ['usb', '115200', '921600', '3000000']
+ERASES		= ['lazy', 'sector', 'chip']
+
+FIELDS		= ['case', 'size', 'chunk', 'link', 'erase', 'seconds', 'throughput', 'erase_s', 'program_s', 'verify_s', 'bytes_out']
+
+here = os.path.dirname(os.path.abspath(__file__))
+
+def case_name(size, chunk, link, erase):
+	return "size=%uK,chunk=%u,link=%s,erase=%s" % (size, chunk, link, erase)
+
+def cases(matrix):
+	if matrix:
+		combos = itertools.product(SIZES, CHUNKS, LINKS, ERASES)
+	else:
+		ref = (SIZES[0], CHUNKS[0], LINKS[0], ERASES[0])
+		combos = [ref]
+		for (axis, values) in enumerate([SIZES, CHUNKS, LINKS, ERASES]):
+			for value in values[1:]:
+				combo = list(ref)
+				combo[axis] = value
+				combos.append(tuple(combo))
+	return list(combos)
+
+#
+# Make an image that looks something like firmware: a mix of code that barely
+# compresses, repetitive tables, zeroed data, and an erased tail.
+#
+def mkimage(size):
+	blocks = []
+	seed = hashlib.sha1("px_bench").digest()
+	for i in range((size - 4096) / 256):
+		seed = hashlib.sha1(seed).digest()
+		kind = i % 4
+		if kind < 2:
+			block = ''.join(hashlib.sha1(seed + chr(j)).digest() for j in range(13))[:256]
+		elif kind == 2:
+			block = seed[:16] * 16
+		else:
+			block = '\0' * 256
+		blocks.append(block)
+	image = ''.join(blocks)
+	return image + '\xff' * (size - len(image))
+
+def mkfirmware(workdir, size):
+	image = os.path.join(workdir, "bench_%uK.bin" % size)
+	fw = os.path.join(workdir, "bench_%uK.px4" % size)
+	if not os.path.exists(fw):
+		with open(image, "wb") as f:
+			f.write(mkimage(size * 1024))
+		with open(fw, "w") as f:
+			subprocess.check_call([sys.executable, os.path.join(here, "px_mkfw.py"),
+					       "--board_id", "5", "--image", image], stdout = f)
+	return fw
+
+# wait for a process to exit, killing it if it takes too long
+def reap(proc, timeout):
+	deadline = time.time() + timeout
+	while proc.poll() is None and time.time() < deadline:
+		time.sleep(0.05)
+	if proc.poll() is None:
+		proc.kill()
+		proc.wait()
+		return False
+	return True
+
+def run_case(workdir, size, chunk, link, erase):
+	fw = mkfirmware(workdir, size)
+	port = os.path.join(workdir, "pty")
+	flash = os.path.join(workdir, "flash.bin")
+	profile = os.path.join(workdir, "profile.jsonl")
+	logfile = os.path.join(workdir, "upload.log")
+	for path in (flash, profile):
+		if os.path.exists(path):
+			os.remove(path)
+
+	# start from blank flash, and never time out of the bootloader
+	sim = [args.sim, "-f", flash, "-p", port, "-t", "0"]
+	up = [sys.executable, os.path.join(here, "px_uploader.py"), "--port", port,
+	      "--chunk", str(chunk), "--profile", profile]
+	if link == 'usb':
+		sim += ["-u"]
+	else:
+		sim += ["-k", "115200"]
+		up += ["--baud", "115200", "--fast-baud", "0" if link == '115200' else link]
+	if erase == 'lazy':
+		up += ["--full"]
+	elif erase == 'chip':
+		up += ["--full", "--chip-erase"]
+	up += [fw]
+
+	with open(logfile, "w") as log:
+		simproc = subprocess.Popen(sim, stdout = log, stderr = subprocess.STDOUT)
+		try:
+			deadline = time.time() + 5
+			while not os.path.exists(port):
+				if time.time() > deadline or simproc.poll() is not None:
+					raise RuntimeError("simulator did not start")
+				time.sleep(0.01)
+			upproc = subprocess.Popen(up, stdout = log, stderr = subprocess.STDOUT)
+			if not reap(upproc, args.timeout):
+				raise RuntimeError("upload timed out")
+			if upproc.returncode != 0:
+				raise RuntimeError("uploader exited with %d" % upproc.returncode)
+		finally:
+			# the simulator exits once it boots the new image
+			reap(simproc, 5)
+
+	with open(profile) as f:
+		report = json.loads(f.readline())
+	if not report['result'].startswith("ok"):
+		raise RuntimeError(report['result'])
+	phases = dict((p['name'], p['duration']) for p in report['phases'])
+	return {
+		'case'		: case_name(size, chunk, link, erase),
+		'size'		: size * 1024,
+		'chunk'		: chunk,
+		'link'		: link,
+		'erase'		: erase,
+		'seconds'	: round(report['duration'], 3),
+		'throughput'	: int(size * 1024 / report['duration']),
+		'erase_s'	: round(phases.get('erase', 0), 3),
+		'program_s'	: round(phases.get('program', 0), 3),
+		'verify_s'	: round(phases.get('verify', 0), 3),
+		'bytes_out'	: report['bytes_out'],
+	}
+
+def write_results(results):
+	if args.csv:
+		with open(args.csv, "w") as f:
+			f.write(",".join(FIELDS) + "\n")
+			for r in results:
+				f.write(",".join(str(r[k]) for k in FIELDS) + "\n")
+	if args.json:
+		with open(args.json, "w") as f:
+			json.dump(results, f, indent = 4, sort_keys = True)
+			f.write("\n")
+
+# returns the cases that have slowed down by more than the tolerance
+def compare(results, baseline):
+	regressed = []
+	for r in results:
+		base = baseline.get(r['case'])
+		if base is None:
+			print("%-60s %8u B/s  (no baseline)" % (r['case'], r['throughput']))
+			continue
+		change = (float(r['throughput']) / base) - 1
+		verdict = ""
+		if change < -args.tolerance:
+			verdict = "  REGRESSED"
+			regressed.append(r['case'])
+		print("%-60s %8u B/s  %+6.1f%%%s" % (r['case'], r['throughput'], change * 100, verdict))
+	return regressed
+
+# Parse commandline arguments
+parser = argparse.ArgumentParser(description="Upload benchmark for the PX4 bootloader, using the host simulator.")
+parser.add_argument('--sim', action="store", default=os.path.join(here, "px4sim_bl.elf"), help="Simulator binary (default is px4sim_bl.elf, from make sim)")
+parser.add_argument('--matrix', action="store_true", help="Run every combination of size, chunk, link and erase strategy")
+parser.add_argument('--repeat', action="store", type=int, default=1, help="Run each case this many times and keep the fastest (default is 1)")
+parser.add_argument('--timeout', action="store", type=float, default=600, help="Seconds to allow for each upload (default is 600)")
+parser.add_argument('--csv', action="store", help="Write the results to this CSV file")
+parser.add_argument('--json', action="store", help="Write the results to this JSON file")
+parser.add_argument('--baseline', action="store", help="Compare throughput against this file, failing on regressions")
+parser.add_argument('--tolerance', action="store", type=float, default=0.2, help="Fraction by which throughput may fall below the baseline (default is 0.2)")
+parser.add_argument('--update-baseline', action="store_true", help="Store the results as the new baseline rather than comparing")
+args = parser.parse_args()
+
+workdir = tempfile.mkdtemp(prefix = "px_bench.")
+results = []
+try:
+	for combo in cases(args.matrix):
+		best = None
+		for i in range(args.repeat):
+			try:
+				r = run_case(workdir, *combo)
+			except (RuntimeError, IOError, OSError, ValueError) as ex:
+				print("%s: ERROR: %s" % (case_name(*combo), ex))
+				with open(os.path.join(workdir, "upload.log")) as f:
+					sys.stdout.write(f.read())
+				sys.exit(1)
+			if best is None or r['throughput'] > best['throughput']:
+				best = r
+		results.append(best)
+		if not args.baseline or args.update_baseline:
+			print("%-60s %8u B/s" % (best['case'], best['throughput']))
+finally:
+	shutil.rmtree(workdir)
+
+write_results(results)
+
+if args.baseline:
+	if args.update_baseline:
+		with open(args.baseline, "w") as f:
+			json.dump(dict((r['case'], r['throughput']) for r in results), f, indent = 4, sort_keys = True)
+			f.write("\n")
+		print("baseline written to %s" % args.baseline)
+	else:
+		with open(args.baseline) as f:
+			baseline = json.load(f)
+		regressed = compare(results, baseline)
+		if regressed:
+			print("%u case(s) slower than the baseline allows" % len(regressed))
+			sys.exit(1)
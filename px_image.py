@@ -0,0 +1,64 @@
+#!/usr/bin/env python
+#
+# Copyright 2012 Michael Smith. All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+#
+#    1. Redistributions of source code must retain the above
+#       copyright notice, this list of conditions and the following
+#       disclaimer.
+#
+#    2. Redistributions in binary form must reproduce the above
+#       copyright notice, this list of conditions and the following
+#       disclaimer in the documentation and/or other materials
+#       provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ''AS IS'' AND ANY
+# EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+# PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+
+#
+# Image helpers shared by px_mkfw.py and px_uploader.py
+#
+
+import array
+import re
+import zlib
+
+# bit-reversal of each byte, for use with str.translate
+_bitrev8 = ''.join(chr(int('{:08b}'.format(i)[::-1], 2)) for i in range(256))
+
+def stm32_crc(data):
+	'''CRC32 as computed by the STM32 CRC unit over little-endian words
+
+	The CRC unit is CRC-32/MPEG-2 fed one 32-bit word at a time, MSB first.
+	That is the bit-reversed form of zlib's CRC32, so bit-reversing each word
+	lets zlib do the work at C speed.'''
+	words = array.array('I', data)
+	if words.itemsize != 4:
+		raise RuntimeError("unsupported platform word size")
+	words.byteswap()
+	crc = zlib.crc32(words.tostring().translate(_bitrev8)) & 0xffffffff
+	return int('{:032b}'.format(crc ^ 0xffffffff)[::-1], 2)
+
+def erased_spans(data, minimum = 64):
+	'''Find word-aligned runs of at least minimum 0xff bytes, as (offset, length)'''
+	spans = []
+	for m in re.finditer('\xff{%u,}' % minimum, data):
+		start = (m.start() + 3) & ~3
+		end = m.end() & ~3
+		if (end - start) >= minimum:
+			spans.append((start, end - start))
+	return spans
@@ -35,6 +35,9 @@
 # The PX4 firmware file is a JSON-encoded Python object, containing
 # metadata fields and a zlib-compressed base64-encoded firmware image.
 #
+# With --binary, a streamable binary container is written instead; see
+# px_uploader.py for the layout.
+#
 
 import sys
 import argparse
@@ -43,6 +46,9 @@ import base64
 import zlib
 import time
 import subprocess
+import struct
+
+from px_image import stm32_crc, erased_spans
 
 #
 # Construct a basic firmware description
@@ -59,8 +65,53 @@ def mkdesc():
 	proto['build_time']	= 0
 	proto['image']		= base64.b64encode(bytearray())
 	proto['image_size']	= 0
+	proto['erased_spans']	= []
 	return proto
 
+#
+# Fill in the application descriptor, if the image has reserved one by
+# putting the magic at APP_DESC_OFFSET; see bl.h
+#
+APP_DESC_OFFSET	= 0x200
+APP_DESC_MAGIC	= 0x44415850
+
+def fill_descriptor(bytes):
+	if len(bytes) < (APP_DESC_OFFSET + 12):
+		return bytes
+	(magic,) = struct.unpack_from('<I', bytes, APP_DESC_OFFSET)
+	if magic != APP_DESC_MAGIC:
+		return bytes
+
+	# the bootloader checks whole words
+	bytes += '\xff' * (-len(bytes) % 4)
+	head = bytes[:APP_DESC_OFFSET + 4] + struct.pack('<I', len(bytes))
+	tail = bytes[APP_DESC_OFFSET + 12:]
+	return head + struct.pack('<I', stm32_crc(head + tail)) + tail
+
+#
+# Pack a description and image into the binary container
+#
+BINARY_MAGIC	= "PX4FWB1\0"
+BINARY_HEADER	= '<8sIIII'
+BINARY_BLOCK	= 16384
+
+def mkbinary(desc, bytes):
+	meta = dict(desc)
+	del meta['image']
+	meta = json.dumps(meta)
+
+	blocks = [bytes[i:i + BINARY_BLOCK] for i in range(0, len(bytes), BINARY_BLOCK)]
+	packed = [zlib.compress(b, 9) for b in blocks]
+
+	offset = struct.calcsize(BINARY_HEADER) + len(meta) + (12 * len(blocks))
+	index = ''
+	for (b, p) in zip(blocks, packed):
+		index += struct.pack('<III', offset, len(p), zlib.crc32(b) & 0xffffffff)
+		offset += len(p)
+
+	header = struct.pack(BINARY_HEADER, BINARY_MAGIC, len(meta), BINARY_BLOCK, len(blocks), len(bytes))
+	return header + meta + index + ''.join(packed)
+
 # Parse commandline
 parser = argparse.ArgumentParser(description="Firmware generator for the PX autopilot system.")
 parser.add_argument("--prototype",	action="store", help="read a prototype description from a file")
@@ -71,6 +122,7 @@ parser.add_argument("--summary",	action="store", help="set a brief description")
 parser.add_argument("--description",	action="store", help="set a longer description")
 parser.add_argument("--git_identity",	action="store", help="the working directory to check for git identity")
 parser.add_argument("--image",		action="store", help="the firmware image")
+parser.add_argument("--binary",		action="store_true", help="write the binary container rather than JSON")
 args = parser.parse_args()
 
 # Fetch the firmware descriptor prototype if specified
@@ -100,8 +152,14 @@ if args.git_identity != None:
 	p.close()
 if args.image != None:
 	f = open(args.image, "rb")
-	bytes = f.read()
+	bytes = fill_descriptor(f.read())
 	desc['image_size'] = len(bytes)
 	desc['image'] = base64.b64encode(zlib.compress(bytes,9))
+	desc['erased_spans'] = erased_spans(bytes)
+else:
+	bytes = zlib.decompress(base64.b64decode(desc['image']))
 
-print json.dumps(desc, indent=4)
+if args.binary:
+	sys.stdout.write(mkbinary(desc, bytes))
+else:
+	print json.dumps(desc, indent=4)
@@ -35,6 +35,21 @@
 # The PX4 firmware file is a JSON-encoded Python object, containing
 # metadata fields and a zlib-compressed base64-encoded firmware image.
 #
+# Alternatively it may be a binary container (px_mkfw.py --binary), which
+# holds the same metadata and the image as independently compressed blocks,
+# so that uploading can start before the whole image has been decoded:
+#
+# header, little-endian
+#	magic		8 bytes, "PX4FWB1\0"
+#	meta_len	uint32, length of the metadata
+#	block_size	uint32, decoded size of each block (the last may be short)
+#	block_count	uint32
+#	image_size	uint32
+# metadata		meta_len bytes of JSON, as the .px4 file without 'image'
+# index			block_count x (offset, length, crc) uint32s; offset is from
+#			the start of the file, crc is zlib's CRC32 of the decoded block
+# blocks		zlib-compressed
+#
 # The uploader uses the following fields from the firmware file:
 #
 # image
@@ -57,27 +72,351 @@ import json
 import zlib
 import base64
 import time
+import collections
+import threading
+import glob
+import select
+import ctypes
+import ctypes.util
+import mmap
+import hashlib
+import contextlib
 
 from sys import platform as _platform
 
+from px_image import stm32_crc, erased_spans
+
+def lz4_compress(data):
+	'''Compress a block in the LZ4 block format
+
+	A simple greedy compressor; bootloader blocks are a few KiB at most, so
+	speed is not much of a concern.  Runs of 0x00/0xff come out as overlapping
+	matches, which is where most of the gain on firmware images comes from.'''
+	n = len(data)
+	out = []
+	table = {}
+	anchor = 0
+	pos = 0
+	mflimit = n - 12	# last match must start at least 12 bytes before the end
+	matchlimit = n - 5	# and the last 5 bytes are always literals
+
+	def length(l):
+		s = ''
+		if l >= 15:
+			l -= 15
+			while l >= 255:
+				s += chr(255)
+				l -= 255
+			s += chr(l)
+		return s
+
+	while pos < mflimit:
+		key = data[pos:pos + 4]
+		ref = table.get(key)
+		table[key] = pos
+		if ref is None or (pos - ref) > 0xffff:
+			pos += 1
+			continue
+
+		# extend the match, quickly over long runs
+		mlen = 4
+		while (pos + mlen + 64) <= matchlimit and data[ref + mlen:ref + mlen + 64] == data[pos + mlen:pos + mlen + 64]:
+			mlen += 64
+		while (pos + mlen) < matchlimit and data[ref + mlen] == data[pos + mlen]:
+			mlen += 1
+
+		litlen = pos - anchor
+		out.append(chr((min(litlen, 15) << 4) | min(mlen - 4, 15)))
+		out.append(length(litlen))
+		out.append(data[anchor:pos])
+		out.append(struct.pack('<H', pos - ref))
+		out.append(length(mlen - 4))
+		pos += mlen
+		anchor = pos
+
+	litlen = n - anchor
+	out.append(chr(min(litlen, 15) << 4))
+	out.append(length(litlen))
+	out.append(data[anchor:])
+	return ''.join(out)
+
+# output from several uploads at once must not interleave mid-line
+_log_lock = threading.Lock()
+
+def log(prefix, msg):
+	with _log_lock:
+		if prefix:
+			print("%s: %s" % (prefix, msg))
+		else:
+			print(msg)
+		sys.stdout.flush()
+
+class inotify(object):
+	'''Minimal inotify binding, just enough to wake up when device nodes appear'''
+
+	IN_ATTRIB	= 0x00000004
+	IN_MOVED_TO	= 0x00000080
+	IN_CREATE	= 0x00000100
+
+	def __init__(self, dirs):
+		libc = ctypes.CDLL(ctypes.util.find_library('c'), use_errno=True)
+		self.fd = libc.inotify_init()
+		if self.fd < 0:
+			raise OSError(ctypes.get_errno(), "inotify_init")
+		for d in dirs:
+			if libc.inotify_add_watch(self.fd, d, inotify.IN_CREATE | inotify.IN_ATTRIB | inotify.IN_MOVED_TO) < 0:
+				raise OSError(ctypes.get_errno(), d)
+
+	def wait(self, timeout):
+		'''True if something changed within timeout seconds; what changed is left to the caller to find out'''
+		(r, w, x) = select.select([self.fd], [], [], timeout)
+		if r:
+			os.read(self.fd, 4096)
+			return True
+		return False
+
+class port_watcher(object):
+	'''Produces lists of ports worth probing for a bootloader
+
+	Patterns may be globs.  A port matching a glob is offered once, as soon as
+	it appears (a USB board that has just reset into its bootloader), and again
+	only if it goes away and comes back; a port that stays is most likely an
+	application that doesn't want to be poked.  Ports named outright are
+	offered again every rescan seconds, as they may never go away, like real
+	serial ports.  Where inotify isn't available it falls back to polling.'''
+
+	def __init__(self, patterns, rescan = 1.0):
+		self.patterns = patterns
+		self.fixed = set(p for p in patterns if not glob.has_magic(p))
+		self.rescan = rescan
+		try:
+			self.inotify = inotify(set(os.path.dirname(p) for p in patterns if glob.has_magic(p) and os.path.isdir(os.path.dirname(p))))
+		except (OSError, AttributeError, TypeError):
+			self.inotify = None
+
+	def ports(self):
+		found = []
+		for pattern in self.patterns:
+			if glob.has_magic(pattern):
+				found += sorted(glob.glob(pattern))
+			else:
+				found.append(pattern)
+		return found
+
+	def batches(self):
+		known = set()
+		last = 0
+		while True:
+			present = self.ports()
+			again = set()
+			if time.time() - last >= self.rescan:
+				again = self.fixed
+				last = time.time()
+			batch = [p for p in present if p not in known or p in again]
+			known = set(present)
+			if batch:
+				yield batch
+
+			if self.inotify is not None:
+				self.inotify.wait(max(0, last + self.rescan - time.time()))
+			else:
+				time.sleep(0.05)
+
 class firmware(object):
-	'''Loads a firmware file'''
+	'''Loads a firmware file
+
+	The image is available as fw.image once loaded; fw[start:end] returns part
+	of it, only waiting for a binary container to be decoded as far as needed.'''
+
+	BINARY_MAGIC	= "PX4FWB1\0"
+	BINARY_HEADER	= '<8sIIII'
 
 	desc = {}
-	image = bytearray()
 
 	def __init__(self, path):
 
+		# prepared data (block lists, checksums) shared by every upload of this image
+		self.__cache = {}
+		self.__cache_lock = threading.Lock()
+
 		# read the file
-		f = open(path, "r")
-		self.desc = json.load(f)
+		f = open(path, "rb")
+		if f.read(len(firmware.BINARY_MAGIC)) == firmware.BINARY_MAGIC:
+			self.__load_binary(f)
+		else:
+			f.seek(0)
+			self.desc = json.load(f)
+			f.close()
+			self.__image = zlib.decompress(base64.b64decode(self.desc['image']))
+
+			# the bootloader programs whole words, so pad out with erased bytes
+			self.__image += '\xff' * (-len(self.__image) % 4)
+			self.__size = len(self.__image)
+			self.__ready = self.__size
+			self.__error = None
+
+		# runs of erased bytes that need not be sent, from the file if px_mkfw.py found them
+		if 'erased_spans' in self.desc:
+			self.spans = [tuple(span) for span in self.desc['erased_spans']]
+		else:
+			self.spans = erased_spans(self.image)
+
+	# map a binary container and start decoding its blocks in the background
+	def __load_binary(self, f):
+		self.__map = mmap.mmap(f.fileno(), 0, access = mmap.ACCESS_READ)
 		f.close()
+		(magic, meta_len, block_size, block_count, image_size) = struct.unpack_from(firmware.BINARY_HEADER, self.__map)
+		offset = struct.calcsize(firmware.BINARY_HEADER)
+		self.desc = json.loads(self.__map[offset:offset + meta_len])
+		offset += meta_len
+		index = [struct.unpack_from('<III', self.__map, offset + (12 * i)) for i in range(block_count)]
+
+		self.__size = (image_size + 3) & ~3
+		self.__buffer = bytearray('\xff' * self.__size)
+		self.__image = None
+		self.__ready = 0
+		self.__error = None
+		self.__cond = threading.Condition()
+
+		t = threading.Thread(target = self.__decode, args = (index, block_size, image_size))
+		t.daemon = True
+		t.start()
+
+	def __decode(self, index, block_size, image_size):
+		offset = 0
+		for (start, length, crc) in index:
+			try:
+				block = zlib.decompress(self.__map[start:start + length])
+			except zlib.error:
+				block = None
+			if block is None or (zlib.crc32(block) & 0xffffffff) != crc or len(block) > block_size:
+				with self.__cond:
+					self.__error = "firmware block at 0x%x is corrupt" % offset
+					self.__cond.notify_all()
+				return
+			self.__buffer[offset:offset + len(block)] = block
+			offset += len(block)
+			with self.__cond:
+				self.__ready = offset
+				self.__cond.notify_all()
+
+		with self.__cond:
+			if offset != image_size:
+				self.__error = "firmware image is truncated"
+			else:
+				self.__ready = self.__size
+			self.__cond.notify_all()
+
+	# wait until the image has been decoded up to end
+	def __wait(self, end):
+		if self.__ready >= end:
+			return
+		with self.__cond:
+			while self.__ready < end and self.__error is None:
+				self.__cond.wait(1)
+		if self.__error is not None:
+			raise RuntimeError(self.__error)
+
+	def __len__(self):
+		return self.__size
 
-		self.image = zlib.decompress(base64.b64decode(self.desc['image']))
+	def __getitem__(self, key):
+		(start, end, step) = key.indices(self.__size)
+		self.__wait(end)
+		if self.__image is not None:
+			return self.__image[start:end]
+		return str(self.__buffer[start:end])
+
+	@property
+	def image(self):
+		if self.__image is None:
+			self.__wait(self.__size)
+			self.__image = str(self.__buffer)
+		return self.__image
 
 	def property(self, propname):
 		return self.desc[propname]
 
+	def cached(self, key):
+		with self.__cache_lock:
+			return self.__cache.get(key)
+
+	def store(self, key, value):
+		with self.__cache_lock:
+			self.__cache[key] = value
+
+
+class profiler(object):
+	'''Timeline of one board's upload: phases, command round trips and retries'''
+
+	# latency histogram bucket upper bounds, in ms
+	BUCKETS	= [0.1, 0.2, 0.5, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000]
+
+	def __init__(self):
+		self.start = time.time()
+		self.phases = []
+		self.latency = {}
+		self.retries = collections.Counter()
+		self.pending = collections.deque()
+		self.bytes_out = 0
+		self.bytes_in = 0
+
+	@contextlib.contextmanager
+	def phase(self, name):
+		start = time.time()
+		(out, inn) = (self.bytes_out, self.bytes_in)
+		try:
+			yield
+		finally:
+			end = time.time()
+			self.phases.append({
+				'name'		: name,
+				'start'		: round(start - self.start, 6),
+				'duration'	: round(end - start, 6),
+				'bytes_out'	: self.bytes_out - out,
+				'bytes_in'	: self.bytes_in - inn,
+				'throughput'	: round((self.bytes_out - out + self.bytes_in - inn) / max(end - start, 1e-6)),
+			})
+
+	# a command went out; replies come back in order, so the oldest one is answered next
+	def sent(self, opcode):
+		self.pending.append((opcode, time.time()))
+
+	def replied(self):
+		if self.pending:
+			(opcode, start) = self.pending.popleft()
+			self.latency.setdefault(opcode, []).append(time.time() - start)
+
+	# anything still outstanding will never be answered
+	def resync(self):
+		self.pending.clear()
+
+	def report(self):
+		commands = {}
+		for (opcode, times) in self.latency.items():
+			histogram = collections.OrderedDict()
+			for bound in profiler.BUCKETS + ['inf']:
+				histogram[str(bound)] = 0
+			for t in times:
+				bound = next((b for b in profiler.BUCKETS if (t * 1000) <= b), 'inf')
+				histogram[str(bound)] += 1
+			commands[uploader.OPCODE_NAMES.get(opcode, '0x%02x' % ord(opcode))] = {
+				'count'		: len(times),
+				'total'		: round(sum(times), 6),
+				'min'		: round(min(times), 6),
+				'max'		: round(max(times), 6),
+				'mean'		: round(sum(times) / len(times), 6),
+				'histogram_ms'	: histogram,
+			}
+		return {
+			'start'		: self.start,
+			'duration'	: round(time.time() - self.start, 6),
+			'bytes_out'	: self.bytes_out,
+			'bytes_in'	: self.bytes_in,
+			'phases'	: sorted(self.phases, key = lambda p: p['start']),
+			'commands'	: commands,
+			'retries'	: dict(self.retries),
+		}
 
 class uploader(object):
 	'''Uploads a firmware file to the PX FMU bootloader'''
@@ -86,6 +425,7 @@ class uploader(object):
 	OK		= chr(0x10)
 	FAILED		= chr(0x11)
 	INSYNC		= chr(0x12)
+	BUSY		= chr(0x13)	# keepalive in place of a framed reply, FEATURE_FRAMES
 	EOC		= chr(0x20)
 	GET_SYNC	= chr(0x21)
 	GET_DEVICE	= chr(0x22)
@@ -93,43 +433,286 @@ class uploader(object):
 	CHIP_VERIFY	= chr(0x24)
 	PROG_MULTI	= chr(0x27)
 	READ_MULTI	= chr(0x28)
+	PROG_SEQ	= chr(0x29)	# FEATURE_SEQ
+	PROG_BULK	= chr(0x2a)	# rev 3+
+	READ_BULK	= chr(0x2b)	# FEATURE_READ_BULK
+	GET_CRC		= chr(0x2c)	# rev 3+
+	PROG_LZ4	= chr(0x2d)	# FEATURE_LZ4
+	GET_SECTOR	= chr(0x2e)	# FEATURE_SECTORS
+	ERASE_SECTOR	= chr(0x2f)	# FEATURE_SECTORS
+	SET_ADDRESS	= chr(0x32)	# FEATURE_SECTORS
+	LAZY_ERASE	= chr(0x33)	# FEATURE_LAZY
+	PROG_SKIP	= chr(0x34)	# FEATURE_SKIP
+	SET_BAUD	= chr(0x35)	# FEATURE_BAUD
 	REBOOT		= chr(0x30)
+	DEBUG		= chr(0x31)	# performance counters, FEATURE_DEBUG
+	FRAME		= chr(0x7e)	# start of a framed command or reply, FEATURE_FRAMES
 	
 	INFO_BL_REV	= chr(1)	# bootloader protocol revision
-	BL_REV		= 2		# supported bootloader protocol 
+	BL_REV_MIN	= 2		# minimum supported bootloader protocol 
+	BL_REV_MAX	= 3		# maximum supported bootloader protocol 
 	INFO_BOARD_ID	= chr(2)	# board type
 	INFO_BOARD_REV	= chr(3)	# board revision
 	INFO_FLASH_SIZE	= chr(4)	# max firmware size in bytes
+	INFO_RX_WINDOW	= chr(5)	# bytes of commands we may send ahead of replies, rev 3+
+	INFO_BULK_MAX	= chr(6)	# largest PROG_BULK count, and READ_BULK's, rev 3+
+	INFO_FEATURES	= chr(7)	# which optional commands there are, rev 3+
+
+	# optional commands, as INFO_FEATURES reports them
+	FEATURE_LZ4	= 1 << 0	# PROG_LZ4
+	FEATURE_SKIP	= 1 << 1	# PROG_SKIP
+	FEATURE_DEBUG	= 1 << 2	# DEBUG
+	FEATURE_FRAMES	= 1 << 3	# framed commands and replies, with BUSY keepalives
+	FEATURE_SECTORS	= 1 << 4	# GET_SECTOR, ERASE_SECTOR and SET_ADDRESS
+	FEATURE_LAZY	= 1 << 5	# LAZY_ERASE
+	FEATURE_READ_BULK = 1 << 6	# READ_BULK
+	FEATURE_BAUD	= 1 << 7	# SET_BAUD
+	FEATURE_SEQ	= 1 << 8	# PROG_SEQ, which PROG_BULK does better
 
 	PROG_MULTI_MAX	= 60		# protocol max is 255, must be multiple of 4
-	READ_MULTI_MAX	= 60		# protocol max is 255, something overflows with >= 64
+	READ_MULTI_MAX	= 252		# protocol max is 255, must be multiple of 4
+	BULK_MAX	= 4096		# largest PROG_BULK/READ_BULK we will send, must be multiple of 4
 
-	def __init__(self, portname, baudrate):
+	# error codes in framed replies
+	ERR_CRC		= 1
+	ERR_SEQUENCE	= 5
+	ERRORS		= ['no error', 'damaged frame', 'bad length', 'address out of range', 'flash error',
+			   'block out of sequence', 'bad compressed data', 'unknown command']
+	FRAME_RETRIES	= 10		# times a frame may be sent again before giving up
+	BLOCK_START	= 256		# program block size to start from, with frames
+	BLOCK_MIN	= 64		# smallest it is cut to on a noisy link
+	BLOCK_GROW	= 8		# clean replies before it is doubled again
+	KEEPALIVE_WAIT	= 1.0		# seconds without a reply or keepalive before a frame is sent again
+
+	def __init__(self, portname, baudrate, fast_baud = 0, prefix = None, chunk = 0):
 		# open the port
 		self.port = serial.Serial(portname, baudrate, timeout=10)
+		self.fast_baud = fast_baud
+		self.chunk = chunk
+		self.prefix = prefix
+		self.profile = profiler()
+
+		# framing, once the bootloader is known to have it
+		self.framed = False
+		self.keepalive = False			# a bootloader busy with the flash says so
+		self.frame_seq = 0
+		self.in_flight = collections.deque()	# (frame seq, command) awaiting replies
+		self.frames = ''			# reply frames, as received
+		self.rx = ''				# replies, unframed
+		self.last_error = 0
+		self.rx_window = 0			# command bytes that may be sent ahead of replies
+		self.block_size = None			# program block size, when it adapts to the link
+		self.clean = 0				# replies since the last retry
+		self.piece_cache = None			# (fw, key) under which compressed pieces are kept
+
+	def __log(self, msg):
+		log(self.prefix, msg)
 
 	def close(self):
 		if self.port is not None:
 			self.port.close()
 
+	# send one whole command
 	def __send(self, c):
+		if c[0] != uploader.REBOOT:
+			self.profile.sent(c[0])
+		if self.framed:
+			self.__sendFrame(c, c[0] != uploader.REBOOT)
+			return
 #		print("send " + binascii.hexlify(c))
 		self.port.write(str(c))
+		self.profile.bytes_out += len(c)
 
+	# send a command in a frame, under a new frame seq unless one is given
+	def __sendFrame(self, c, reply = True, seq = None):
+		if seq is None:
+			seq = self.frame_seq
+			self.frame_seq = (self.frame_seq + 1) & 0xff
+			if reply:
+				self.in_flight.append((seq, c))
+		body = struct.pack('<HB', len(c), seq) + c
+		frame = uploader.FRAME + body + struct.pack('<H', binascii.crc_hqx(body, 0xffff))
+		self.port.write(frame)
+		self.profile.bytes_out += len(frame)
+
+	# replies are taken from rx, which framed replies are unpacked into
 	def __recv(self, count = 1):
-		c = self.port.read(count)
-		if (len(c) < 1):
-			raise RuntimeError("timeout waiting for data")
-#		print("recv " + binascii.hexlify(c))
+		while self.framed and len(self.rx) < count:
+			self.__nextReply()
+		if len(self.rx) < count:
+			c = self.port.read(count - len(self.rx))
+			if (len(c) < 1):
+				raise RuntimeError("timeout waiting for data")
+#			print("recv " + binascii.hexlify(c))
+			self.profile.bytes_in += len(c)
+			self.rx += c
+		c = self.rx[:count]
+		self.rx = self.rx[count:]
 		return c
 
+	# Read a reply frame as (seq, status, error, data); None if there was
+	# only a damaged one, or False if nothing came at all.  Frames are found
+	# by their marker, so the remains of a damaged one are searched for the
+	# next marker, until the link goes quiet.
+	def __readFrame(self):
+		buf = self.frames
+		damaged = False
+		quiet = False
+		while True:
+			start = buf.find(uploader.FRAME)
+			if start != 0:
+				damaged = damaged or len(buf) > 0
+				buf = buf[start:] if start > 0 else ''
+			need = 6
+			if len(buf) >= 6:
+				(length, seq, status, error) = struct.unpack_from('<HBcB', buf, 1)
+				need = 6 + length + 2
+				if (len(buf) >= need and length <= uploader.BULK_MAX and
+				    struct.unpack_from('<H', buf, need - 2)[0] == binascii.crc_hqx(buf[1:need - 2], 0xffff)):
+					self.frames = buf[need:]
+					return (seq, status, error, buf[6:need - 2])
+				if len(buf) >= need or length > uploader.BULK_MAX:
+					buf = buf[1:]
+					damaged = True
+					continue
+			if quiet:
+				if not buf:
+					self.frames = ''
+					return None
+				buf = buf[1:]
+				continue
+
+			# the rest of a frame comes all at once, and so does the next
+			# after the remains of a damaged one
+			timeout = self.port.timeout
+			if buf or damaged:
+				self.port.timeout = 0.05 + (need * 10.0 / self.port.baudrate)
+			elif self.keepalive:
+				self.port.timeout = min(timeout, uploader.KEEPALIVE_WAIT)
+			try:
+				c = self.port.read(need - len(buf))
+			finally:
+				self.port.timeout = timeout
+			if len(c) < 1:
+				if not (buf or damaged):
+					self.frames = ''
+					return False
+				quiet = True
+				continue
+			self.profile.bytes_in += len(c)
+			buf += c
+
+	# Take the reply to the oldest frame in flight, and queue it up as the
+	# unframed reply would have come.  A frame the bootloader found damaged
+	# is sent again along with any behind it, which it will have dropped.  A
+	# reply that was damaged or lost is asked for again by repeating the last
+	# frame with the same seq, which the bootloader answers without doing it
+	# twice.  The reply to a sequenced block also answers for any before it
+	# whose replies went astray, as the bootloader refuses a block after a
+	# bad one; but a block refused as out of order, with earlier ones still
+	# unanswered, means those were dropped (behind a NAK that itself went
+	# astray), and they are all sent again as for a NAK.  A keepalive only
+	# means the bootloader is still busy with the flash, so the wait goes on;
+	# with them, a reply that is lost is noticed within KEEPALIVE_WAIT.
+	def __nextReply(self):
+		if not self.in_flight:
+			raise RuntimeError("no reply expected")
+		retries = 0
+		while True:
+			reply = self.__readFrame()
+			if reply is None and len(self.in_flight) > 1:
+				# a later reply will say what became of it
+				continue
+			elif reply and reply[1] == uploader.BUSY:
+				continue
+			elif reply is None or reply is False:
+				self.profile.retries['reply'] += 1
+				self.__shrink()
+				(seq, cmd) = self.in_flight[-1]
+				self.__sendFrame(cmd, seq = seq)
+			elif reply[1] == uploader.FAILED and (reply[2] == uploader.ERR_CRC or
+			    (reply[2] == uploader.ERR_SEQUENCE and self.__dropped(reply[0]))):
+				self.profile.retries['frame'] += 1
+				self.__shrink()
+				frames = list(self.in_flight)
+				self.in_flight.clear()
+				for (seq, cmd) in frames:
+					self.__sendFrame(cmd)
+			else:
+				(rseq, status, error, data) = reply
+				seqs = [seq for (seq, cmd) in self.in_flight]
+				if rseq not in seqs:
+					# the answer to a frame that has since been sent again
+					continue
+				(seq, cmd) = self.in_flight[seqs.index(rseq)]
+				while self.in_flight[0][0] != rseq:
+					(lost, earlier) = self.in_flight.popleft()
+					if earlier[0] not in uploader.SEQUENCED or cmd[0] not in uploader.SEQUENCED:
+						raise RuntimeError("lost the reply to frame %u" % lost)
+					self.profile.retries['reply'] += 1
+					self.rx += earlier[1] + uploader.INSYNC + uploader.OK
+				self.in_flight.popleft()
+				self.last_error = error
+				self.rx += data + uploader.INSYNC + status
+				self.__grow()
+				return
+			retries += 1
+			if retries > uploader.FRAME_RETRIES:
+				raise RuntimeError("frame %u still not through after %u retries" % (self.in_flight[0][0], retries - 1))
+
+	# Program blocks start small and are doubled after each run of clean
+	# replies, up to bulk_max, and halved whenever a frame has to be sent
+	# again; a damaged frame costs its whole length, so on a noisy link the
+	# blocks stay small enough for most of them to get through.  There is no
+	# telling a USB link from a UART behind a USB adapter, so every upload
+	# starts this way.
+	def __shrink(self):
+		self.clean = 0
+		if self.block_size is not None:
+			self.block_size = max(uploader.BLOCK_MIN, (self.block_size // 2) & ~3)
+
+	def __grow(self):
+		self.clean += 1
+		if self.block_size is not None and self.clean >= uploader.BLOCK_GROW:
+			self.clean = 0
+			self.block_size = min(self.bulk_max, self.block_size * 2)
+
+	# whether frame seq is in flight behind others, which must have been dropped
+	def __dropped(self, seq):
+		seqs = [s for (s, cmd) in self.in_flight]
+		return seq in seqs[1:]
+
+	# why the last framed command failed, if the bootloader said
+	def __failure(self):
+		if self.framed and self.last_error < len(uploader.ERRORS):
+			return " (%s)" % uploader.ERRORS[self.last_error]
+		return ""
+
 	def __getSync(self):
 		c = self.__recv()
 		if (c != self.INSYNC):
 			raise RuntimeError("unexpected 0x%x instead of INSYNC" % ord(c))
 		c = self.__recv()
+		if (c == self.FAILED):
+			raise RuntimeError("bootloader reported a failure" + self.__failure())
 		if (c != self.OK):
 			raise RuntimeError("unexpected 0x%x instead of OK" % ord(c))
+		self.profile.replied()
+
+	# wait for the sequence-tagged reply to a PROG_SEQ command
+	def __getSeqSync(self, seq):
+		c = self.__recv()
+		if (ord(c) != seq):
+			raise RuntimeError("unexpected sequence %u instead of %u" % (ord(c), seq))
+		c = self.__recv()
+		if (c != self.INSYNC):
+			raise RuntimeError("unexpected 0x%x instead of INSYNC" % ord(c))
+		c = self.__recv()
+		if (c == self.FAILED):
+			raise RuntimeError("programming failed at or before block %u%s" % (seq, self.__failure()))
+		if (c != self.OK):
+			raise RuntimeError("unexpected 0x%x instead of OK" % ord(c))
+		self.profile.replied()
 
 	# attempt to get back into sync with the bootloader
 	def __sync(self):
@@ -137,8 +720,25 @@ class uploader(object):
 		# that we might still have in progress
 #		self.__send(uploader.NOP * (uploader.PROG_MULTI_MAX + 2))
 		self.port.flushInput()
+		self.profile.resync()
+		self.in_flight.clear()
+		self.frames = ''
+		self.rx = ''
 		self.__send(uploader.GET_SYNC 
 				+ uploader.EOC)
+
+		# a bootloader left part way through a framed upload may still be
+		# throwing it away, and NAKs the sync in a frame
+		if not self.framed:
+			self.rx = self.__recv()
+			if self.rx == uploader.FRAME:
+				time.sleep(0.1)
+				self.port.flushInput()
+				self.profile.resync()
+				self.rx = ''
+				self.framed = True
+				self.__send(uploader.GET_SYNC
+						+ uploader.EOC)
 		self.__getSync()
 		
 	def __trySync(self):
@@ -160,18 +760,76 @@ class uploader(object):
 		value = struct.unpack_from('<I', raw)
 		return value[0]
 
+	# move the link to a faster line rate, falling back to the current one if it won't work
+	def __setBaud(self, baud):
+		old = self.port.baudrate
+		self.__send(uploader.SET_BAUD
+				+ struct.pack("<I", baud)
+				+ uploader.EOC)
+		self.__getSync()
+
+		# the reply came at the old rate; the bootloader has switched now
+		self.port.baudrate = baud
+		timeout = self.port.timeout
+		self.port.timeout = 0.5
+		try:
+			self.__sync()
+			return True
+		except RuntimeError:
+			# the bootloader goes back to the old rate by itself after a second
+			self.profile.retries['baud'] += 1
+			self.port.baudrate = old
+			time.sleep(1.5)
+			self.__sync()
+			return False
+		finally:
+			self.port.timeout = timeout
+
 	# send the CHIP_ERASE command and wait for the bootloader to become ready
 	def __erase(self):
 		self.__send(uploader.CHIP_ERASE 
 				+ uploader.EOC)
 		self.__getSync()
 
+	# send the LAZY_ERASE command; sectors are erased as programming reaches them
+	def __eraseLazy(self):
+		self.__send(uploader.LAZY_ERASE
+				+ uploader.EOC)
+		self.__getSync()
+
+	# get the size and CRC of each flash sector
+	def __getSectors(self):
+		sectors = []
+		while True:
+			self.__send(uploader.GET_SECTOR
+					+ chr(len(sectors))
+					+ uploader.EOC)
+			(size, crc) = struct.unpack('<II', self.__recv(8))
+			self.__getSync()
+			if size == 0:
+				return sectors
+			sectors.append((size, crc))
+
+	# send the ERASE_SECTOR command and wait for the bootloader to become ready
+	def __eraseSector(self, sector):
+		self.__send(uploader.ERASE_SECTOR
+				+ chr(sector)
+				+ uploader.EOC)
+		self.__getSync()
+
+	# send the SET_ADDRESS command to move the program address
+	def __setAddress(self, address):
+		self.__send(uploader.SET_ADDRESS
+				+ struct.pack('<I', address)
+				+ uploader.EOC)
+		self.__getSync()
+
 	# send a PROG_MULTI command to write a collection of bytes
 	def __program_multi(self, data):
 		self.__send(uploader.PROG_MULTI
-				+ chr(len(data)))
-		self.__send(data)
-		self.__send(uploader.EOC)
+				+ chr(len(data))
+				+ data
+				+ uploader.EOC)
 		self.__getSync()
 		
 	# verify multiple bytes in flash
@@ -179,10 +837,14 @@ class uploader(object):
 		self.__send(uploader.READ_MULTI
 				+ chr(len(data))
 				+ uploader.EOC)
+		return self.__verify_reply(data)
+
+	# compare the reply to a read command with what we expect
+	def __verify_reply(self, data):
 		programmed = self.__recv(len(data))
 		if (programmed != data):
-			print("got    " + binascii.hexlify(programmed))
-			print("expect " + binascii.hexlify(data))
+			self.__log("got    " + binascii.hexlify(programmed))
+			self.__log("expect " + binascii.hexlify(data))
 			return False
 		self.__getSync()
 		return True
@@ -191,124 +853,672 @@ class uploader(object):
 	def __reboot(self):
 		self.__send(uploader.REBOOT)
 
-	# split a sequence into a list of size-constrained pieces
-	def __split_len(self, seq, length):
-    		return [seq[i:i+length] for i in range(0, len(seq), length)]
+	# split [start, end) of a sequence into size-constrained pieces as they
+	# are needed, so that a streamed image is only waited for as far as is sent
+	def __pieces(self, seq, start, end, length):
+		for i in range(start, end, length):
+			yield seq[i:min(i + length, end)]
+
+	# as __pieces, for program blocks, each as big as block_size is by then
+	# and with where it starts
+	def __block_pieces(self, seq, start, end):
+		i = start
+		while i < end:
+			length = self.block_size or self.bulk_max
+			yield (i, seq[i:min(i + length, end)])
+			i += length
 
 	# upload code
 	def __program(self, fw):
-		code = fw.image
-		groups = self.__split_len(code, uploader.PROG_MULTI_MAX)
-		for bytes in groups:
-			self.__program_multi(bytes)
+		self.__program_bytes(fw, fw.spans, fw, ('image',))
+
+	# upload bytes from the current program address onwards, skipping over
+	# the (offset, length) spans of erased bytes if the bootloader can; if
+	# the bytes come from fw, the blocks are kept in its cache under key
+	def __program_bytes(self, code, spans, fw = None, key = None):
+		if self.bl_rev < 3:
+			groups = self.__pieces(code, 0, len(code), uploader.PROG_MULTI_MAX)
+			for bytes in groups:
+				self.__program_multi(bytes)
+			return
+
+		blocks = None
+		self.piece_cache = None
+		if fw is not None:
+			# the blocks depend on which commands the bootloader has, and their size
+			key += (self.features & (uploader.FEATURE_LZ4 | uploader.FEATURE_SKIP), self.bulk_max)
+			if self.block_size is not None:
+				# blocks are cut to suit the link as they go, so only the
+				# compressed pieces can be kept, by where they start and size
+				self.piece_cache = (fw, key)
+			else:
+				blocks = fw.cached(key)
+		if blocks is None:
+			blocks = self.__blocks(code, spans)
+			if fw is not None and self.piece_cache is None:
+				blocks = self.__record(fw, key, blocks)
+		self.__program_seq(blocks)
+
+	# the sequenced commands that program code
+	def __blocks(self, code, spans):
+		if self.features & uploader.FEATURE_SKIP:
+			return self.__skip_blocks(code, spans)
+		groups = self.__block_pieces(code, 0, len(code))
+		return (self.__compress(g, at) for (at, g) in groups)
+
+	# pass blocks through, and once they have all been produced cache them
+	def __record(self, fw, key, blocks):
+		done = []
+		for block in blocks:
+			done.append(block)
+			yield block
+		fw.store(key, done)
+
+	# STM32 CRC of part of the image, padded with erased bytes to size
+	def __image_crc(self, fw, offset, size):
+		key = ('crc', offset, size)
+		crc = fw.cached(key)
+		if crc is None:
+			data = fw[offset:offset + size]
+			data += '\xff' * (size - len(data))
+			crc = stm32_crc(data)
+			fw.store(key, crc)
+		return crc
+
+	# blocks for the data between erased spans, and skips over the spans
+	def __skip_blocks(self, code, spans):
+		offset = 0
+		for (start, length) in spans + [(len(code), 0)]:
+			for (at, g) in self.__block_pieces(code, offset, start):
+				yield self.__compress(g, at)
+			if length > 0:
+				yield (uploader.PROG_SKIP, struct.pack('<I', length))
+			offset = start + length
+
+	# the block for the bytes at offset at, from the cache if it is there
+	def __compress(self, bytes, at):
+		if self.piece_cache is None:
+			return self.__pack(bytes)
+		(fw, key) = self.piece_cache
+		key += (at, len(bytes))
+		block = fw.cached(key)
+		if block is None:
+			block = self.__pack(bytes)
+			fw.store(key, block)
+		return block
+
+	# pick the smaller of the compressed and raw forms of a block
+	def __pack(self, bytes):
+		if not self.features & uploader.FEATURE_LZ4:
+			return (uploader.PROG_BULK, struct.pack('<H', len(bytes)) + bytes)
+		packed = lz4_compress(bytes)
+		if len(packed) < len(bytes):
+			return (uploader.PROG_LZ4, struct.pack('<H', len(packed)) + packed)
+		return (uploader.PROG_BULK, struct.pack('<H', len(bytes)) + bytes)
+
+	# send (opcode, command data) blocks with as many sequenced commands in
+	# flight as the bootloader can buffer, only waiting for a reply when the
+	# window is full
+	def __program_seq(self, blocks):
+		pending = collections.deque()
+		outstanding = 0
+		seq = 0
+		for (opcode, data) in blocks:
+			cmd = (opcode
+				+ chr(seq)
+				+ data
+				+ uploader.EOC)
+			while pending and (outstanding + len(cmd)) > self.rx_window:
+				(done, length) = pending.popleft()
+				self.__getSeqSync(done)
+				outstanding -= length
+			self.__send(cmd)
+			pending.append((seq, len(cmd)))
+			outstanding += len(cmd)
+			seq = (seq + 1) & 0xff
+		while pending:
+			(done, length) = pending.popleft()
+			self.__getSeqSync(done)
+
+	# read back the whole of flash, for backup or forensics
+	def dump(self):
+		self.__send(uploader.CHIP_VERIFY
+				+ uploader.EOC)
+		self.__getSync()
+
+		if self.features & uploader.FEATURE_READ_BULK:
+			step = self.bulk_max
+			read = lambda n: uploader.READ_BULK + struct.pack('<H', n) + uploader.EOC
+		else:
+			step = uploader.READ_MULTI_MAX
+			read = lambda n: uploader.READ_MULTI + chr(n) + uploader.EOC
+
+		# keep a few reads queued so that the link never goes idle, where
+		# the bootloader can hold them; framed reads go one at a time, as a
+		# read whose reply is lost can only be asked for again while it is
+		# the last
+		depth = 0 if self.framed else min(4, self.rx_window // len(read(step)))
+		data = []
+		pending = collections.deque()
+		for offset in range(0, self.fw_maxsize, step):
+			count = min(step, self.fw_maxsize - offset)
+			self.__send(read(count))
+			pending.append(count)
+			while pending and (len(pending) > depth or offset + count >= self.fw_maxsize):
+				count = pending.popleft()
+				block = self.__recv(count)
+				if len(block) != count:
+					raise RuntimeError("timeout reading flash")
+				self.__getSync()
+				data.append(block)
+		return ''.join(data)
 
 	# verify code
 	def __verify(self, fw):
+		if self.bl_rev >= 3:
+			self.__verify_crc(fw)
+			return
 		self.__send(uploader.CHIP_VERIFY
 				+ uploader.EOC)
 		self.__getSync()
-		code = fw.image
-		groups = self.__split_len(code, uploader.READ_MULTI_MAX)
-		for bytes in groups:
+		for bytes in self.__pieces(fw, 0, len(fw), uploader.READ_MULTI_MAX):
 			if (not self.__verify_multi(bytes)):
 				raise RuntimeError("Verification failed")
 
+	# work out which sectors differ from the image, as (sector, offset, size)
+	def __dirtySectors(self, fw):
+		sectors = self.__getSectors()
+		dirty = []
+		offset = 0
+		for (sector, (size, crc)) in enumerate(sectors):
+			if offset < len(fw):
+				# the flash past the end of the image should be erased
+				if self.__image_crc(fw, offset, size) != crc:
+					dirty.append((sector, offset, size))
+			offset += size
+
+		# the first word is only programmed at reboot, so sector 0 has to
+		# be rewritten along with anything else to keep that guarantee
+		if dirty and dirty[0][0] != 0:
+			dirty.insert(0, (0, 0, sectors[0][0]))
+		return dirty
+
+	# verify code by having the bootloader checksum it
+	def __verify_crc(self, fw):
+		self.__send(uploader.GET_CRC
+				+ struct.pack('<I', len(fw))
+				+ uploader.EOC)
+		crc = struct.unpack('<I', self.__recv(4))[0]
+		self.__getSync()
+		expect = self.__image_crc(fw, 0, len(fw))
+		if crc != expect:
+			self.__log("got    0x%08x" % crc)
+			self.__log("expect 0x%08x" % expect)
+			raise RuntimeError("Verification failed")
+
+	# PROTO_DEBUG counters, as a dict
+	STATS_FIELDS	= [('erase_cycles', 'Q'), ('program_cycles', 'Q'), ('wait_cycles', 'Q'),
+			   ('bytes_received', 'I'), ('overflows', 'I'), ('commands', 'I'),
+			   ('sectors_erased', 'I'), ('words_programmed', 'I')]
+
+	def __getStats(self):
+		self.__send(uploader.DEBUG
+				+ uploader.EOC)
+		(version, length) = struct.unpack('<II', self.__recv(8))
+		raw = self.__recv(length)
+		self.__getSync()
+		if version != 1:
+			raise RuntimeError("unknown counter layout version %u" % version)
+
+		# later layouts only add fields, so anything past what we know is ignored
+		stats = {}
+		(stats['cycle_hz'],) = struct.unpack_from('<I', raw)
+		offset = 4
+		for (name, fmt) in uploader.STATS_FIELDS:
+			(stats[name],) = struct.unpack_from('<' + fmt, raw, offset)
+			offset += struct.calcsize(fmt)
+
+		# not a counter, so kept apart from the others
+		if len(raw) >= (offset + 4):
+			(stats['boot_check_cycles'],) = struct.unpack_from('<I', raw, offset)
+		return stats
+
+	# report how the counters moved since before
+	def __logStats(self, before):
+		after = self.__getStats()
+		d = dict((name, after[name] - before[name]) for (name, fmt) in uploader.STATS_FIELDS)
+		hz = float(after['cycle_hz'])
+		self.__log("stats: erase %.2fs (%u sectors), program %.2fs (%u words), waiting for host %.2fs" %
+			(d['erase_cycles'] / hz, d['sectors_erased'], d['program_cycles'] / hz, d['words_programmed'], d['wait_cycles'] / hz))
+		self.__log("stats: %u bytes received, %u lost to overflow, %u commands" %
+			(d['bytes_received'], d['overflows'], d['commands']))
+		if after.get('boot_check_cycles'):
+			self.__log("stats: checking the image took %.2fms on the way in" % (after['boot_check_cycles'] * 1000 / hz))
+
 	# get basic data about the board
-	def identify(self):
-		# make sure we are in sync before starting
-		self.__sync()
+	def identify(self, timeout = None):
+		# make sure we are in sync before starting; a bootloader answers at once,
+		# so a short timeout here stops ports without one holding us up
+		saved = self.port.timeout
+		if timeout is not None:
+			self.port.timeout = timeout
+		try:
+			with self.profile.phase('sync'):
+				self.__sync()
+		finally:
+			self.port.timeout = saved
+
+		with self.profile.phase('identify'):
+			self.__identify()
 
+	def __identify(self):
 		# get the bootloader protocol ID first
-		bl_rev = self.__getInfo(uploader.INFO_BL_REV)
-		if bl_rev != uploader.BL_REV:
+		self.bl_rev = self.__getInfo(uploader.INFO_BL_REV)
+		if (self.bl_rev < uploader.BL_REV_MIN) or (self.bl_rev > uploader.BL_REV_MAX):
 			raise RuntimeError("Bootloader protocol mismatch")
 
+		self.features = 0
+		if self.bl_rev >= 3:
+			self.features = self.__getInfo(uploader.INFO_FEATURES)
+
+		# from here on, a damaged command or reply can be sent again by itself
+		self.framed = bool(self.features & uploader.FEATURE_FRAMES)
+		self.keepalive = self.framed
+
 		self.board_type = self.__getInfo(uploader.INFO_BOARD_ID)
 		self.board_rev = self.__getInfo(uploader.INFO_BOARD_REV)
 		self.fw_maxsize = self.__getInfo(uploader.INFO_FLASH_SIZE)
+		if self.bl_rev >= 3:
+			self.rx_window = self.__getInfo(uploader.INFO_RX_WINDOW)
+			self.bulk_max = min(self.__getInfo(uploader.INFO_BULK_MAX), self.chunk or uploader.BULK_MAX, uploader.BULK_MAX) & ~3
+		if self.framed:
+			self.block_size = min(self.bulk_max, uploader.BLOCK_START)
+		if self.features & uploader.FEATURE_BAUD and self.fast_baud and self.fast_baud != self.port.baudrate:
+			with self.profile.phase('baud'):
+				switched = self.__setBaud(self.fast_baud)
+			if not switched:
+				self.__log("could not switch to %u baud, staying at %u" % (self.fast_baud, self.port.baudrate))
 
 	# upload the firmware
-	def upload(self, fw):
+	def upload(self, fw, full = False, chip_erase = False, stats = False):
 		# Make sure we are doing the right thing
 		if self.board_type != fw.property('board_id'):
 			raise RuntimeError("Firmware not suitable for this board")
 		if self.fw_maxsize < fw.property('image_size'):
 			raise RuntimeError("Firmware image is too large for this board")
 
-		print("erase...")
-		self.__erase()
+		before = None
+		if stats:
+			if self.features & uploader.FEATURE_DEBUG:
+				before = self.__getStats()
+			else:
+				self.__log("bootloader has no performance counters")
+
+		if self.features & uploader.FEATURE_SECTORS and not full:
+			# only rewrite the sectors that have changed
+			with self.profile.phase('compare'):
+				dirty = self.__dirtySectors(fw)
+			if not dirty:
+				if before is not None:
+					self.__logStats(before)
+				self.__log("unchanged, rebooting.")
+				with self.profile.phase('reboot'):
+					self.__reboot()
+				self.port.close()
+				return
+
+			self.__log("erase %u sectors..." % len(dirty))
+			with self.profile.phase('erase'):
+				for (sector, offset, size) in dirty:
+					self.__eraseSector(sector)
+
+			self.__log("program...")
+			with self.profile.phase('program'):
+				for (sector, offset, size) in dirty:
+					self.__setAddress(offset)
+					code = fw[offset:offset + size]
+					self.__program_bytes(code, erased_spans(code), fw, ('sector', offset, size))
+		elif self.features & uploader.FEATURE_LAZY and not chip_erase:
+			# let the bootloader erase as it goes
+			with self.profile.phase('erase'):
+				self.__eraseLazy()
+
+			self.__log("program...")
+			with self.profile.phase('program'):
+				self.__program(fw)
+		else:
+			self.__log("erase...")
+			with self.profile.phase('erase'):
+				self.__erase()
 
-		print("program...")
-		self.__program(fw)
+			self.__log("program...")
+			with self.profile.phase('program'):
+				self.__program(fw)
 
-		print("verify...")
-		self.__verify(fw)
+		self.__log("verify...")
+		with self.profile.phase('verify'):
+			self.__verify(fw)
 
-		print("done, rebooting.")
-		self.__reboot()
+		if before is not None:
+			self.__logStats(before)
+		self.__log("done, rebooting.")
+		with self.profile.phase('reboot'):
+			self.__reboot()
 		self.port.close()
 	
 
-# Parse commandline arguments
-parser = argparse.ArgumentParser(description="Firmware uploader for the PX autopilot system.")
-parser.add_argument('--port', action="store", required=True, help="Serial port(s) to which the FMU may be attached")
-parser.add_argument('--baud', action="store", type=int, default=115200, help="Baud rate of the serial port (default is 115200), only required for true serial ports.")
-parser.add_argument('firmware', action="store", help="Firmware file to be uploaded")
-args = parser.parse_args()
+# commands the bootloader refuses if one before them went missing
+uploader.SEQUENCED = [uploader.PROG_SEQ, uploader.PROG_BULK, uploader.PROG_LZ4, uploader.PROG_SKIP]
 
-# Load the firmware file
-fw = firmware(args.firmware)
-print("Loaded firmware for %x,%x, waiting for the bootloader..." % (fw.property('board_id'), fw.property('board_revision')))
+uploader.OPCODE_NAMES = dict((getattr(uploader, name), name) for name in [
+	'GET_SYNC', 'GET_DEVICE', 'CHIP_ERASE', 'CHIP_VERIFY', 'PROG_MULTI', 'READ_MULTI',
+	'PROG_SEQ', 'PROG_BULK', 'READ_BULK', 'GET_CRC', 'PROG_LZ4', 'GET_SECTOR',
+	'ERASE_SECTOR', 'SET_ADDRESS', 'LAZY_ERASE', 'PROG_SKIP', 'SET_BAUD', 'DEBUG'])
 
-# Spin waiting for a device to show up
-while True:
-	for port in args.port.split(","):
+# append one board's profile to the --profile file, as a line of JSON
+_profile_lock = threading.Lock()
 
-		#print("Trying %s" % port)
+def write_profile(up, port, fw, result, probes = 0):
+	if not args.profile:
+		return
+	report = up.profile.report()
+	report['port'] = port
+	report['result'] = result
+	report['board_type'] = getattr(up, 'board_type', None)
+	report['board_rev'] = getattr(up, 'board_rev', None)
+	report['bl_rev'] = getattr(up, 'bl_rev', None)
+	report['firmware'] = dict((k, fw.desc.get(k)) for k in ('board_id', 'board_revision', 'version', 'git_identity', 'build_time', 'image_size'))
+	report['retries']['probe'] = probes
+	with _profile_lock:
+		with open(args.profile, "a") as f:
+			f.write(json.dumps(report, sort_keys = True) + "\n")
 
-		# create an uploader attached to the port
-		try:
-			if "linux" in _platform:
-			# Linux, don't open Mac OS and Win ports
-				if not "COM" in port and not "tty.usb" in port:
-					up = uploader(port, args.baud)
-			elif "darwin" in _platform:
-				# OS X, don't open Windows and Linux ports
-				if not "COM" in port and not "ACM" in port:
-					up = uploader(port, args.baud)
-			elif "win" in _platform:
-				# Windows, don't open POSIX ports
-				if not "/" in port:
-					up = uploader(port, args.baud)
-		except:
-			# open failed, rate-limit our attempts
-			time.sleep(0.05)
+# open an uploader on a port, unless it belongs to some other platform
+def open_port(port, prefix = None):
+	if "linux" in _platform:
+		# Linux, don't open Mac OS and Win ports
+		if "COM" in port or "tty.usb" in port:
+			return None
+	elif "darwin" in _platform:
+		# OS X, don't open Windows and Linux ports
+		if "COM" in port or "ACM" in port:
+			return None
+	elif "win" in _platform:
+		# Windows, don't open POSIX ports
+		if "/" in port:
+			return None
+	return uploader(port, args.baud, args.fast_baud, prefix, args.chunk)
 
-			# and loop to the next port
-			continue
+# flash the board on a port if it has a bootloader; returns None if it
+# doesn't, otherwise how it went
+def try_flash(port, fw, results = None, probes = 0):
+	try:
+		up = open_port(port, port)
+	except:
+		return None
+	if up is None:
+		return None
+	try:
+		up.identify(args.probe_timeout)
+	except:
+		# most probably a timeout talking to the port, no bootloader
+		up.close()
+		return None
 
-		# port is open, try talking to it
-		try:
-			# identify the bootloader
-			up.identify()
-			print("Found board %x,%x on %s" % (up.board_type, up.board_rev, port))
+	log(port, "found board %x,%x" % (up.board_type, up.board_rev))
+	if results is not None:
+		results[port] = "interrupted"
+	start = time.time()
+	result = "interrupted"
+	try:
+		up.upload(fw, args.full, args.chip_erase, args.stats)
+		result = "ok in %.1fs" % (time.time() - start)
+	except RuntimeError as ex:
+		log(port, "ERROR: %s" % ex.args)
+		result = "failed: %s" % ex.args
+	except serial.SerialException as ex:
+		log(port, "ERROR: %s" % ex)
+		result = "failed: %s" % ex
+	finally:
+		write_profile(up, port, fw, result, probes)
+		up.close()
+	return result
 
+# wait for a bootloader on one port and flash it, recording the outcome in results
+def flash_port(port, fw, results):
+	deadline = (time.time() + args.wait) if args.wait else None
+	results[port] = "not found"
+	probes = 0
+
+	while True:
+		result = try_flash(port, fw, results, probes)
+		probes += 1
+		if result is not None:
+			results[port] = result
+			return
+		if deadline is not None and time.time() > deadline:
+			log(port, "no bootloader found")
+			return
+		time.sleep(0.05)
+
+# try all the ports at once, returning an uploader for each one with a bootloader
+def probe(ports):
+	found = []
+
+	def try_port(port):
+		try:
+			up = open_port(port)
+		except:
+			return
+		if up is None:
+			return
+		try:
+			up.identify(args.probe_timeout)
+			up.name = port
+			found.append(up)
 		except:
 			# most probably a timeout talking to the port, no bootloader
+			up.close()
+
+	threads = [threading.Thread(target = try_port, args = (port,)) for port in ports]
+	for t in threads:
+		t.start()
+	for t in threads:
+		t.join()
+	return found
+
+# flash every port at once, then summarise
+def flash_parallel(ports, fw):
+	results = {}
+	threads = []
+	for port in ports:
+		t = threading.Thread(target = flash_port, args = (port, fw, results))
+		t.daemon = True
+		t.start()
+		threads.append(t)
+
+	# join with a timeout so that ^C still works
+	try:
+		while any(t.is_alive() for t in threads):
+			time.sleep(0.1)
+	except KeyboardInterrupt:
+		print("")
+
+	print("Summary:")
+	ok = 0
+	failed = 0
+	for port in ports:
+		result = results.get(port, "not found")
+		if result.startswith("ok"):
+			ok += 1
+		elif result.startswith("failed"):
+			failed += 1
+		print("  %s: %s" % (port, result))
+	print("%u of %u boards flashed, %u failed" % (ok, len(ports), failed))
+	sys.exit(0 if ok == len(ports) else 1)
+
+# read back the flash of the first board found; it is left in the bootloader
+def dump_flash(ports, path):
+	for batch in port_watcher(ports).batches():
+		found = probe(batch)
+		if not found:
 			continue
 
+		up = found.pop(0)
+		for other in found:
+			other.close()
+		print("Found board %x,%x on %s, reading %u bytes..." % (up.board_type, up.board_rev, up.name, up.fw_maxsize))
+		start = time.time()
 		try:
-			# ok, we have a bootloader, try flashing it
-			up.upload(fw)
-
+			image = up.dump()
 		except RuntimeError as ex:
-
-			# print the error
 			print("ERROR: %s" % ex.args)
-
+			sys.exit(1)
 		finally:
-			# always close the port
 			up.close()
 
-		# we could loop here if we wanted to wait for more boards...
+		with open(path, "wb") as f:
+			f.write(image)
+		print("Wrote %s in %.1fs" % (path, time.time() - start))
 		sys.exit(0)
+
+class image_cache(object):
+	'''Firmware loaded from a file, kept by content hash
+
+	The file is only read again when it changes, and an image (with everything
+	uploads have prepared from it) is only loaded once however often the file
+	goes back and forth between versions.'''
+
+	def __init__(self, path, keep = 4):
+		self.path = path
+		self.keep = keep
+		self.images = collections.OrderedDict()
+		self.stamp = None
+		self.hash = None
+
+	def get(self):
+		st = os.stat(self.path)
+		stamp = (st.st_mtime, st.st_size)
+		if stamp != self.stamp:
+			with open(self.path, "rb") as f:
+				self.hash = hashlib.sha1(f.read()).hexdigest()
+			self.stamp = stamp
+
+		if self.hash not in self.images:
+			fw = firmware(self.path)
+			log(None, "loaded firmware %s for %x,%x" % (self.hash[:12], fw.property('board_id'), fw.property('board_revision')))
+			self.images[self.hash] = fw
+			while len(self.images) > self.keep:
+				self.images.popitem(last = False)
+		return self.images[self.hash]
+
+# flash every board that turns up with the current firmware, until interrupted
+def run_daemon(ports):
+	cache = image_cache(args.firmware)
+	busy = set()
+	lock = threading.Lock()
+	counts = {"ok": 0, "failed": 0}
+
+	def flash(port, fw):
+		try:
+			result = try_flash(port, fw)
+			if result is not None:
+				log(port, result)
+				with lock:
+					counts["ok" if result.startswith("ok") else "failed"] += 1
+		finally:
+			with lock:
+				busy.discard(port)
+
+	log(None, "waiting for boards on %s..." % ", ".join(ports))
+	try:
+		for batch in port_watcher(ports).batches():
+			try:
+				fw = cache.get()
+			except (IOError, OSError, ValueError, KeyError) as ex:
+				log(None, "ERROR: cannot load %s: %s" % (args.firmware, ex))
+				time.sleep(1)
+				continue
+
+			for port in batch:
+				with lock:
+					if port in busy:
+						continue
+					busy.add(port)
+				t = threading.Thread(target = flash, args = (port, fw))
+				t.daemon = True
+				t.start()
+	except KeyboardInterrupt:
+		print("")
+		with lock:
+			log(None, "%u boards flashed, %u failed" % (counts["ok"], counts["failed"]))
+			sys.exit(0 if counts["failed"] == 0 else 1)
+
+# Parse commandline arguments
+parser = argparse.ArgumentParser(description="Firmware uploader for the PX autopilot system.")
+parser.add_argument('--port', action="store", required=True, help="Serial port(s) to which the FMU may be attached, comma-separated; globs such as /dev/ttyACM* are watched for new devices")
+parser.add_argument('--baud', action="store", type=int, default=115200, help="Baud rate of the serial port (default is 115200), only required for true serial ports.")
+parser.add_argument('--fast-baud', action="store", type=int, default=921600, help="Baud rate to switch to once the bootloader is found (default is 921600, 0 to stay at --baud)")
+parser.add_argument('--full', action="store_true", help="Erase and rewrite the whole image, even where the board already has it")
+parser.add_argument('--chip-erase', action="store_true", help="With --full, erase all of flash up front rather than sectors as they are reached")
+parser.add_argument('--chunk', action="store", type=int, default=0, help="Largest block to program with one command (default is the most the bootloader accepts, up to 4096)")
+parser.add_argument('--probe-timeout', action="store", type=float, default=0.5, help="Seconds to wait for a bootloader to answer on a port (default is 0.5)")
+parser.add_argument('--parallel', action="store_true", help="Flash a board on every port in --port at the same time, rather than the first one found")
+parser.add_argument('--wait', action="store", type=float, default=0, help="With --parallel, give up on a port after this many seconds without a bootloader (default is to wait forever)")
+parser.add_argument('--stats', action="store_true", help="Report where the bootloader spent its time during the upload")
+parser.add_argument('--profile', action="store", help="Append a JSON line per board to this file, timing each phase and command of the upload")
+parser.add_argument('--daemon', action="store_true", help="Keep running, flashing every board that appears; the firmware file is reloaded when it changes")
+parser.add_argument('--dump', action="store", help="Rather than uploading, save the whole of the board's flash to this file")
+parser.add_argument('firmware', action="store", nargs='?', help="Firmware file to be uploaded")
+args = parser.parse_args()
+
+if args.dump:
+	dump_flash(args.port.split(","), args.dump)
+if args.firmware is None:
+	parser.error("a firmware file is needed unless --dump is given")
+
+if args.daemon:
+	run_daemon(args.port.split(","))
+
+# Load the firmware file
+fw = firmware(args.firmware)
+print("Loaded firmware for %x,%x, waiting for the bootloader..." % (fw.property('board_id'), fw.property('board_revision')))
+
+if args.parallel:
+	flash_parallel(args.port.split(","), fw)
+
+# Wait for a device to show up, probing ports as they appear
+for ports in port_watcher(args.port.split(",")).batches():
+	found = probe(ports)
+	if not found:
+		continue
+
+	# take the first board found; any others can wait for another run
+	up = found.pop(0)
+	for other in found:
+		other.close()
+	print("Found board %x,%x on %s" % (up.board_type, up.board_rev, up.name))
+
+	result = "interrupted"
+	try:
+		# ok, we have a bootloader, try flashing it
+		up.upload(fw, args.full, args.chip_erase, args.stats)
+		result = "ok"
+
+	except RuntimeError as ex:
+
+		# print the error
+		print("ERROR: %s" % ex.args)
+		result = "failed: %s" % ex.args
+
+	except serial.SerialException as ex:
+		print("ERROR: %s" % ex)
+		result = "failed: %s" % ex
+
+	finally:
+		# always close the port
+		write_profile(up, up.name, fw, result)
+		up.close()
+
+	# we could loop here if we wanted to wait for more boards...
+	sys.exit(0 if result == "ok" else 1)
@@ -0,0 +1,42 @@
+/*
+ * Host simulator stand-ins for the libopencm3 interfaces used by bl.c.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+/* systick */
+#define STK_CTRL_CLKSOURCE_AHB	1
+
+extern void systick_set_clocksource(uint8_t clocksource);
+extern void systick_set_reload(uint32_t value);
+extern void systick_interrupt_enable(void);
+extern void systick_interrupt_disable(void);
+extern void systick_counter_enable(void);
+extern void systick_counter_disable(void);
+extern void sys_tick_handler(void);
+
+/* flash controller */
+extern void flash_lock(void);
+extern void flash_unlock(void);
+
+/* vector table offset register */
+extern volatile uint32_t sim_vtor;
+#define SCB_VTOR		sim_vtor
+
+/* called by do_jump() in place of the jump into the application */
+extern void sim_boot(uint32_t stacktop, uint32_t entrypoint) __attribute__((noreturn));
+
+/* interface configuration passed to cinit() */
+struct sim_link {
+	const char	*path;		/* symlink to the pty, if any */
+	uint32_t	baud;		/* line rate to emulate; 0 leaves the link unpaced */
+	bool		usb;		/* emulate a full-speed USB CDC link instead */
+	unsigned	noise;		/* corrupt about one byte in this many each way; 0 for none */
+};
+
+/* account for time some simulated hardware is busy; see main_sim.c */
+extern void sim_busy(struct timespec *ready, unsigned long usec, unsigned long slack);
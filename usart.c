@@ -1,18 +1,31 @@
 /*
  * USART interface for the bootloader.
+ *
+ * Both directions are run by DMA, so that bytes keep arriving while the CPU
+ * is busy (or stalled) programming flash.  libopencm3's DMA support differs
+ * between F1 and F4, so the handful of registers needed are driven directly.
+ *
+ * The small protocol (PROTO_SMALL, see bl.c) never has the host send ahead,
+ * so there the USART is simply polled, as it always was, and keeps the line
+ * rate it starts at.
  */
 
-#ifdef STM32F4
+#if defined(STM32F4)
 # include <libopencm3/stm32/f4/rcc.h>
 # include <libopencm3/stm32/f4/gpio.h>
+#elif defined(STM32F1)
+# include <libopencm3/stm32/f1/rcc.h>
 #endif
 
 #include <libopencm3/stm32/usart.h>
 
 #include "bl.h"
 
+#define USART_DEFAULT_BAUD	115200
+
 uint32_t usart;
 
+#ifdef PROTO_SMALL
 void
 cinit(void *config)
 {
@@ -21,8 +34,7 @@ cinit(void *config)
 	/* board is expected to do pin and clock setup */
 
         /* do usart setup */
-        //USART_CR1(usart) |= (1 << 15);	/* because libopencm3 doesn't know the OVER8 bit */
-        usart_set_baudrate(usart, 115200);
+        usart_set_baudrate(usart, USART_DEFAULT_BAUD);
         usart_set_databits(usart, 8);
         usart_set_stopbits(usart, USART_STOPBITS_1);
         usart_set_mode(usart, USART_MODE_TX_RX);
@@ -31,20 +43,6 @@ cinit(void *config)
 
         /* and enable */
         usart_enable(usart);
-
-
-#if 0
-        usart_send_blocking(usart, 'B');
-        usart_send_blocking(usart, 'B');
-        usart_send_blocking(usart, 'B');
-        usart_send_blocking(usart, 'B');
-
-        while (true) {
-        	int c;
-        	c = usart_recv_blocking(usart);
-        	usart_send_blocking(usart, c);
-        }
-#endif
 }
 
 void
@@ -69,3 +67,251 @@ cout(uint8_t *buf, unsigned len)
 	while (len--)
 		usart_send_blocking(usart, *buf++);
 }
+
+unsigned
+cin_window(void)
+{
+	/* only what the USART holds */
+	return 0;
+}
+
+#else
+#define USART_MIN_BAUD		9600
+
+#define RX_RING_SIZE		1024		/* must be a power of two */
+#define TX_BUF_SIZE		256
+
+#if defined(STM32F4)
+/* DMA stream registers */
+# define DMA_STREAM_CR(dma, s)		MMIO32((dma) + 0x10 + (0x18 * (s)))
+# define DMA_STREAM_NDTR(dma, s)	MMIO32((dma) + 0x14 + (0x18 * (s)))
+# define DMA_STREAM_PAR(dma, s)		MMIO32((dma) + 0x18 + (0x18 * (s)))
+# define DMA_STREAM_M0AR(dma, s)	MMIO32((dma) + 0x1c + (0x18 * (s)))
+# define DMA_STREAM_IFCR(dma, s)	MMIO32((dma) + (((s) < 4) ? 0x08 : 0x0c))
+# define DMA_STREAM_IFCR_ALL(s)		(0x3d << ((((s) & 2) ? 16 : 0) + (((s) & 1) ? 6 : 0)))
+# define DMA_STREAM_CR_EN		(1 << 0)
+# define DMA_STREAM_CR_DIR_M2P		(1 << 6)
+# define DMA_STREAM_CR_CIRC		(1 << 8)
+# define DMA_STREAM_CR_MINC		(1 << 10)
+# define DMA_STREAM_CR_CHSEL(c)		((c) << 25)
+# define DMA_DIR_M2P			DMA_STREAM_CR_DIR_M2P
+# define DMA_CIRC			DMA_STREAM_CR_CIRC
+#else
+/* DMA channel registers; channels are numbered from 1 */
+# define DMA_CHAN_IFCR(dma)		MMIO32((dma) + 0x04)
+# define DMA_CHAN_CR(dma, c)		MMIO32((dma) + 0x08 + (0x14 * ((c) - 1)))
+# define DMA_CHAN_NDTR(dma, c)		MMIO32((dma) + 0x0c + (0x14 * ((c) - 1)))
+# define DMA_CHAN_PAR(dma, c)		MMIO32((dma) + 0x10 + (0x14 * ((c) - 1)))
+# define DMA_CHAN_MAR(dma, c)		MMIO32((dma) + 0x14 + (0x14 * ((c) - 1)))
+# define DMA_CHAN_IFCR_ALL(c)		(0xf << (4 * ((c) - 1)))
+# define DMA_CHAN_CR_EN			(1 << 0)
+# define DMA_CHAN_CR_DIR_M2P		(1 << 4)
+# define DMA_CHAN_CR_CIRC		(1 << 5)
+# define DMA_CHAN_CR_MINC		(1 << 7)
+# define DMA_DIR_M2P			DMA_CHAN_CR_DIR_M2P
+# define DMA_CIRC			DMA_CHAN_CR_CIRC
+#endif
+
+/*
+ * DMA assignments are fixed by the chip for each USART.  The table is left
+ * in RAM, as cout() reads it while flash is being erased (see RAMFUNC).
+ */
+static struct usart_dma {
+	uint32_t	usart;
+	uint32_t	dma;
+	uint8_t		rx;		/* stream (F4) or channel (F1) */
+	uint8_t		tx;
+	uint8_t		chsel;		/* channel selection for both streams (F4) */
+} usart_dma[] = {
+#if defined(STM32F4)
+	{ USART1, DMA2_BASE, 2, 7, 4 },
+	{ USART2, DMA1_BASE, 5, 6, 4 },
+	{ USART3, DMA1_BASE, 1, 3, 4 },
+#else
+	{ USART1, DMA1_BASE, 5, 4, 0 },
+	{ USART2, DMA1_BASE, 6, 7, 0 },
+	{ USART3, DMA1_BASE, 3, 2, 0 },
+#endif
+};
+
+static struct usart_dma *dma;
+
+static uint8_t rx_ring[RX_RING_SIZE];
+static unsigned rx_tail;
+static uint8_t tx_buf[TX_BUF_SIZE];
+
+static RAMFUNC void
+dma_start(unsigned stream, uint32_t mode, void *mem, unsigned count)
+{
+#if defined(STM32F4)
+	DMA_STREAM_CR(dma->dma, stream) = 0;
+	while (DMA_STREAM_CR(dma->dma, stream) & DMA_STREAM_CR_EN)
+		;
+	DMA_STREAM_IFCR(dma->dma, stream) = DMA_STREAM_IFCR_ALL(stream);
+	DMA_STREAM_PAR(dma->dma, stream) = (uint32_t)&USART_DR(usart);
+	DMA_STREAM_M0AR(dma->dma, stream) = (uint32_t)mem;
+	DMA_STREAM_NDTR(dma->dma, stream) = count;
+	DMA_STREAM_CR(dma->dma, stream) = mode | DMA_STREAM_CR_MINC | DMA_STREAM_CR_CHSEL(dma->chsel) | DMA_STREAM_CR_EN;
+#else
+	DMA_CHAN_CR(dma->dma, stream) = 0;
+	DMA_CHAN_IFCR(dma->dma) = DMA_CHAN_IFCR_ALL(stream);
+	DMA_CHAN_PAR(dma->dma, stream) = (uint32_t)&USART_DR(usart);
+	DMA_CHAN_MAR(dma->dma, stream) = (uint32_t)mem;
+	DMA_CHAN_NDTR(dma->dma, stream) = count;
+	DMA_CHAN_CR(dma->dma, stream) = mode | DMA_CHAN_CR_MINC | DMA_CHAN_CR_EN;
+#endif
+}
+
+static void
+dma_stop(unsigned stream)
+{
+#if defined(STM32F4)
+	DMA_STREAM_CR(dma->dma, stream) = 0;
+#else
+	DMA_CHAN_CR(dma->dma, stream) = 0;
+#endif
+}
+
+static RAMFUNC unsigned
+dma_remaining(unsigned stream)
+{
+#if defined(STM32F4)
+	return DMA_STREAM_NDTR(dma->dma, stream);
+#else
+	return DMA_CHAN_NDTR(dma->dma, stream);
+#endif
+}
+
+/* wait for everything queued by cout() to have left the USART */
+static void
+tx_drain(void)
+{
+	while (dma_remaining(dma->tx) != 0)
+		;
+	while (!(USART_SR(usart) & USART_SR_TC))
+		;
+}
+
+void
+cinit(void *config)
+{
+	unsigned i;
+
+	usart = (uint32_t)config;
+
+	/* board is expected to do pin and USART clock setup; DMA is up to us */
+	dma = &usart_dma[0];
+	for (i = 0; i < (sizeof(usart_dma) / sizeof(usart_dma[0])); i++)
+		if (usart_dma[i].usart == usart)
+			dma = &usart_dma[i];
+#if defined(STM32F4)
+	rcc_peripheral_enable_clock(&RCC_AHB1ENR, (dma->dma == DMA2_BASE) ? RCC_AHB1ENR_DMA2EN : RCC_AHB1ENR_DMA1EN);
+#else
+	rcc_peripheral_enable_clock(&RCC_AHBENR, RCC_AHBENR_DMA1EN);
+#endif
+
+        /* do usart setup */
+        //USART_CR1(usart) |= (1 << 15);	/* because libopencm3 doesn't know the OVER8 bit */
+        usart_set_baudrate(usart, USART_DEFAULT_BAUD);
+        usart_set_databits(usart, 8);
+        usart_set_stopbits(usart, USART_STOPBITS_1);
+        usart_set_mode(usart, USART_MODE_TX_RX);
+        usart_set_parity(usart, USART_PARITY_NONE);
+        usart_set_flow_control(usart, USART_FLOWCONTROL_NONE);
+
+	/* receive continuously into the ring, transmit on demand */
+	USART_CR3(usart) |= USART_CR3_DMAR | USART_CR3_DMAT;
+	rx_tail = 0;
+	dma_start(dma->rx, DMA_CIRC, rx_ring, RX_RING_SIZE);
+
+        /* and enable */
+        usart_enable(usart);
+}
+
+void
+cfini(void)
+{
+	tx_drain();
+	dma_stop(dma->rx);
+	dma_stop(dma->tx);
+	USART_CR3(usart) &= ~(USART_CR3_DMAR | USART_CR3_DMAT);
+	usart_disable(usart);
+}
+
+int
+cin(void)
+{
+	unsigned head = (RX_RING_SIZE - dma_remaining(dma->rx)) & (RX_RING_SIZE - 1);
+	int c;
+
+	if (rx_tail == head)
+		return -1;
+	c = rx_ring[rx_tail];
+	rx_tail = (rx_tail + 1) & (RX_RING_SIZE - 1);
+	return c;
+}
+
+unsigned
+cin_bulk(uint8_t *buf, unsigned len)
+{
+	unsigned head = (RX_RING_SIZE - dma_remaining(dma->rx)) & (RX_RING_SIZE - 1);
+	unsigned avail = (head - rx_tail) & (RX_RING_SIZE - 1);
+	unsigned i;
+
+	if (len > avail)
+		len = avail;
+	for (i = 0; i < len; i++)
+		buf[i] = rx_ring[(rx_tail + i) & (RX_RING_SIZE - 1)];
+	rx_tail = (rx_tail + len) & (RX_RING_SIZE - 1);
+	return len;
+}
+
+RAMFUNC void
+cout(uint8_t *buf, unsigned len)
+{
+	unsigned i;
+
+	while (len) {
+		unsigned count = (len > TX_BUF_SIZE) ? TX_BUF_SIZE : len;
+
+		/* the previous transfer may still be using the buffer */
+		while (dma_remaining(dma->tx) != 0)
+			;
+		for (i = 0; i < count; i++)
+			tx_buf[i] = buf[i];
+		dma_start(dma->tx, DMA_DIR_M2P, tx_buf, count);
+
+		buf += count;
+		len -= count;
+	}
+}
+
+RAMFUNC void
+cidle(void)
+{
+	/* no interrupt comes with the bytes the DMA takes in, so keep looking */
+}
+
+unsigned
+cin_window(void)
+{
+	/* the ring must never be lapped */
+	return RX_RING_SIZE - 1;
+}
+
+int
+cset_baud(uint32_t baud)
+{
+	uint32_t pclk = (usart == USART1) ? rcc_ppre2_frequency : rcc_ppre1_frequency;
+
+	if (baud == 0)
+		baud = USART_DEFAULT_BAUD;
+	if ((baud < USART_MIN_BAUD) || (baud > (pclk / 16)))
+		return -1;
+
+	/* let anything we have already said go out at the old rate */
+	tx_drain();
+	usart_set_baudrate(usart, baud);
+	return 0;
+}
+#endif